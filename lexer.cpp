@@ -1,8 +1,123 @@
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <map>
 #include <memory>
+#include <new>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+// the x86-64 JIT and object files are built in on these hosts
+#if defined(__x86_64__) && defined(__unix__)
+#include <elf.h>
+#define CHALICE_HAVE_JIT 1
+#endif
+
+// the LLVM backend is optional, build it in with
+//   g++ -DCHALICE_WITH_LLVM lexer.cpp $(llvm-config --cxxflags --ldflags --libs)
+#ifdef CHALICE_WITH_LLVM
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#endif
+
+
+/*******************************************************************************
+* Allocation accounting
+* the global operator new is replaced to count heap allocations per thread,
+* so the cost of parsing an item can be measured. counting is only switched
+* on for the modes that report or limit memory, otherwise new and delete go
+* straight to malloc and free
+*******************************************************************************/
+
+// set by the options that need the counters, before anything is parsed.
+// memory allocated earlier isn't counted but is subtracted when it's freed
+static bool CountAllocs = false;
+
+struct AllocCounters {
+	size_t Count;	// allocations made by this thread
+	size_t Bytes;	// bytes requested by them
+	// heap bytes in use and their high-water mark. memory freed by another
+	// thread than the one that allocated it makes Live drift, so these are
+	// only meaningful for single-threaded work
+	ptrdiff_t Live;
+	ptrdiff_t Peak;
+};
+
+static thread_local AllocCounters ThreadAllocs;
+
+// count an allocation of Size bytes of which Usable are in use
+static void CountAlloc(size_t Size, size_t Usable) {
+	++ThreadAllocs.Count;
+	ThreadAllocs.Bytes += Size;
+	ThreadAllocs.Live += Usable;
+	ThreadAllocs.Peak = std::max(ThreadAllocs.Peak, ThreadAllocs.Live);
+}
+
+// malloc that never returns null
+static void *CheckedMalloc(size_t Size) {
+	if (void *P = malloc(Size ? Size : 1))
+		return P;
+	fputs("fatal error: out of memory\n", stderr);
+	fflush(stderr);
+	abort();
+}
+
+void *operator new(size_t Size) {
+	void *P = CheckedMalloc(Size);
+	if (CountAllocs)
+		CountAlloc(Size, malloc_usable_size(P));
+	return P;
+}
+
+// kept out of line, otherwise gcc sees free() applied to memory from new
+__attribute__((noinline)) void operator delete(void *P) noexcept {
+	if (CountAllocs)
+		ThreadAllocs.Live -= malloc_usable_size(P);
+	free(P);
+}
+
+__attribute__((noinline)) void operator delete(void *P, size_t) noexcept {
+	if (CountAllocs)
+		ThreadAllocs.Live -= malloc_usable_size(P);
+	free(P);
+}
+
+// heap ceiling in bytes for --stream, 0 for none
+static ptrdiff_t MemoryLimit = 0;
+// set when the ceiling was hit in the middle of an item. the parser then
+// sees end of input, which unwinds it, and the item is dropped
+static bool OverMemoryLimit = false;
+
+// true once the heap has gone over the ceiling during the current item
+static bool CheckMemoryLimit() {
+	if (MemoryLimit && ThreadAllocs.Live > MemoryLimit)
+		OverMemoryLimit = true;
+	return OverMemoryLimit;
+}
+
 
 /*******************************************************************************
 *	Lexer
@@ -20,31 +135,85 @@ enum Token {
 	// primary
 	tok_identifier = -4,
 	tok_number = -5,
+
+	// control
+	tok_if = -6,
+	tok_then = -7,
+	tok_else = -8,
 };
 
 // IdentifierStr holds the namke of the identifier, if tok_identifier is set
-static std::string IdentifierStr;
+// both are thread_local so worker threads can parse from their own token buffers
+static thread_local std::string IdentifierStr;
 // NumVal holds the numerical value of tok_number, if set
-static double NumVal;
+static thread_local double NumVal;
 
-static int gettok() {
-	static int LastChar = ' ';
+struct SourceLocation {
+	int Line;
+	int Col;
+};
+// name of the file being read, null for stdin
+static const char *InputName = nullptr;
+// CurLoc is the location of the current token, LexLoc where the lexer is at
+static thread_local SourceLocation CurLoc;
+static thread_local SourceLocation LexLoc = {1, 0};
+
+// the lexer reads from InputFile, LastChar is the character it looked at last.
+// worker threads lex their own slices of the input
+static thread_local FILE *InputFile = stdin;
+static thread_local int LastChar = ' ';
+
+// start lexing F from the beginning
+static void ResetLexer(FILE *F) {
+	InputFile = F;
+	LastChar = ' ';
+	LexLoc = {1, 0};
+}
+
+static int advance() {
+	int LastChar = getc(InputFile);
+
+	if (LastChar == '\n' || LastChar == '\r') {
+		LexLoc.Line++;
+		LexLoc.Col = 0;
+	} else
+		LexLoc.Col++;
+	return LastChar;
+}
 
+static int gettok() {
 	// skip whitespace
 	while (isspace(LastChar))
-		LastChar = getchar();
+		LastChar = advance();
+
+	CurLoc = LexLoc;
 
 
 	// check for identifiers and other reserved words
 	if (isalpha(LastChar)) {
 		IdentifierStr = LastChar;
-		while (isalnum((LastChar = getchar())))
+		while (isalnum((LastChar = advance()))) {
+			// one identifier can be enough to go over the memory limit,
+			// then the rest of it is skipped and the item dropped
+			if (CheckMemoryLimit()) {
+				while (isalnum((LastChar = advance())))
+					;
+				std::string().swap(IdentifierStr);
+				return tok_identifier;
+			}
 			IdentifierStr += LastChar;
+		}
 
 		if (IdentifierStr == "def")
 			return tok_def;
 		if (IdentifierStr == "extern")
 			return tok_extern;
+		if (IdentifierStr == "if")
+			return tok_if;
+		if (IdentifierStr == "then")
+			return tok_then;
+		if (IdentifierStr == "else")
+			return tok_else;
 		return tok_identifier;
 	}
 
@@ -52,8 +221,15 @@ static int gettok() {
 	if (isdigit(LastChar) || LastChar == '.') {
 		std::string NumStr;
 		do {
+			// the same for numbers
+			if (CheckMemoryLimit()) {
+				while (isdigit(LastChar) || LastChar == '.')
+					LastChar = advance();
+				NumVal = 0;
+				return tok_number;
+			}
 			NumStr += LastChar;
-			LastChar = getchar();
+			LastChar = advance();
 		} while (isdigit(LastChar) || LastChar == '.');
 
 		NumVal = strtod(NumStr.c_str(), 0);
@@ -63,7 +239,7 @@ static int gettok() {
 	// ignore comment lines starting with #
 	if (LastChar == '#') {
 		do {
-			LastChar = getchar();
+			LastChar = advance();
 		} while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
 		if (LastChar != EOF)
@@ -75,10 +251,194 @@ static int gettok() {
 		return tok_eof;
 
 	int ThisChar = LastChar;
-	LastChar = getchar();
+	LastChar = advance();
 	return ThisChar;
 }
 
+// TokenRec - a lexed token together with its value, as kept in a token buffer
+struct TokenRec {
+	int Tok;
+	std::string IdentifierStr;
+	double NumVal;
+	SourceLocation Loc;
+};
+
+// lex all of InputFile up front, used when the parser runs from a token buffer
+static std::vector<TokenRec> LexAll() {
+	std::vector<TokenRec> Toks;
+	int Tok;
+	while ((Tok = gettok()) != tok_eof) {
+		TokenRec Rec = {Tok, std::string(), 0, CurLoc};
+		if (Tok == tok_identifier)
+			Rec.IdentifierStr = IdentifierStr;
+		else if (Tok == tok_number)
+			Rec.NumVal = NumVal;
+		Toks.push_back(std::move(Rec));
+	}
+	// keep an explicit eof so errors at the end of input get a location
+	Toks.push_back({tok_eof, std::string(), 0, CurLoc});
+	return Toks;
+}
+
+
+/*******************************************************************************
+* SmallVector
+* vector that keeps its first N elements inline and only goes to the heap when
+* it grows past that. argument lists are nearly always short, so this saves an
+* allocation per call and prototype
+*******************************************************************************/
+
+template <typename T, unsigned N>
+class SmallVector {
+	T *Begin;
+	unsigned Size = 0;
+	unsigned Capacity = N;
+	alignas(T) unsigned char Inline[N * sizeof(T)];
+
+	bool isInline() const { return Begin == reinterpret_cast<const T *>(Inline); }
+
+	void grow() {
+		Capacity *= 2;
+		T *New = static_cast<T *>(::operator new(Capacity * sizeof(T)));
+		for (unsigned I = 0; I < Size; ++I) {
+			new (New + I) T(std::move(Begin[I]));
+			Begin[I].~T();
+		}
+		if (!isInline())
+			::operator delete(Begin);
+		Begin = New;
+	}
+
+	void destroy() {
+		for (unsigned I = 0; I < Size; ++I)
+			Begin[I].~T();
+		if (!isInline())
+			::operator delete(Begin);
+	}
+
+	// take Other's elements, Other has to be empty-able afterwards
+	void steal(SmallVector &Other) {
+		if (Other.isInline()) {
+			Begin = reinterpret_cast<T *>(Inline);
+			Capacity = N;
+			for (unsigned I = 0; I < Other.Size; ++I) {
+				new (Begin + I) T(std::move(Other.Begin[I]));
+				Other.Begin[I].~T();
+			}
+		} else {
+			Begin = Other.Begin;
+			Capacity = Other.Capacity;
+			Other.Begin = reinterpret_cast<T *>(Other.Inline);
+			Other.Capacity = N;
+		}
+		Size = Other.Size;
+		Other.Size = 0;
+	}
+
+public:
+	SmallVector() : Begin(reinterpret_cast<T *>(Inline)) {}
+	SmallVector(SmallVector &&Other) { steal(Other); }
+	SmallVector(const SmallVector &Other) : SmallVector() {
+		for (auto &E : Other)
+			push_back(E);
+	}
+	~SmallVector() { destroy(); }
+
+	SmallVector &operator=(SmallVector &&Other) {
+		if (this != &Other) {
+			destroy();
+			steal(Other);
+		}
+		return *this;
+	}
+	SmallVector &operator=(const SmallVector &Other) {
+		if (this != &Other) {
+			SmallVector Copy(Other);
+			*this = std::move(Copy);
+		}
+		return *this;
+	}
+
+	void push_back(T &&E) {
+		if (Size == Capacity)
+			grow();
+		new (Begin + Size++) T(std::move(E));
+	}
+	void push_back(const T &E) {
+		if (Size == Capacity)
+			grow();
+		new (Begin + Size++) T(E);
+	}
+
+	T *begin() { return Begin; }
+	T *end() { return Begin + Size; }
+	const T *begin() const { return Begin; }
+	const T *end() const { return Begin + Size; }
+	T &operator[](unsigned I) { return Begin[I]; }
+	const T &operator[](unsigned I) const { return Begin[I]; }
+	unsigned size() const { return Size; }
+	unsigned capacity() const { return Capacity; }
+	bool empty() const { return Size == 0; }
+	// heap bytes in use, 0 while the elements are inline
+	size_t heapBytes() const { return isInline() ? 0 : Capacity * sizeof(T); }
+};
+
+
+/*******************************************************************************
+* Node pools
+* expression nodes are small and made and dropped in great numbers. they come
+* from free lists by size carved out of big blocks, one pool per parser
+* thread, so threads parsing in parallel never contend for the heap. nodes
+* are counted as allocations as they are handed out and given back, memory
+* the pool keeps for later nodes isn't
+*******************************************************************************/
+
+class NodePool {
+	static const size_t Granule = 16;
+	static const size_t MaxSize = 128;
+	static const size_t BlockSize = 64 << 10;
+	void *Free[MaxSize / Granule] = {};
+	char *Next = nullptr;
+	char *End = nullptr;
+
+public:
+	void *allocate(size_t Size) {
+		if (Size > MaxSize)
+			return ::operator new(Size);
+		size_t C = (Size - 1) / Granule;
+		if (CountAllocs)
+			CountAlloc(Size, (C + 1) * Granule);
+		if (void *P = Free[C]) {
+			Free[C] = *static_cast<void **>(P);
+			return P;
+		}
+		size_t Bytes = (C + 1) * Granule;
+		if (size_t(End - Next) < Bytes) {
+			// the rest of the old block is left unused, blocks are
+			// never given back
+			Next = static_cast<char *>(CheckedMalloc(BlockSize));
+			End = Next + BlockSize;
+		}
+		void *P = Next;
+		Next += Bytes;
+		return P;
+	}
+	// P goes to this pool whichever pool it came from
+	void deallocate(void *P, size_t Size) {
+		if (Size > MaxSize)
+			return ::operator delete(P);
+		size_t C = (Size - 1) / Granule;
+		if (CountAllocs)
+			ThreadAllocs.Live -= (C + 1) * Granule;
+		*static_cast<void **>(P) = Free[C];
+		Free[C] = P;
+	}
+};
+
+// the main thread's pool, parser threads are given one of their own
+static NodePool MainNodePool;
+static thread_local NodePool *ThreadNodePool = &MainNodePool;
+
 
 /*******************************************************************************
 * Abstract Syntax Tree
@@ -88,24 +448,55 @@ static int gettok() {
 namespace {
 
 // Expressions AST
+// every node carries a kind tag, passes dispatch on it with visit() below
+// instead of virtual calls or dynamic_cast
 class ExprAST {
 public: 
+	enum ExprKind { EK_Number, EK_Variable, EK_Binary, EK_Call, EK_If };
+
+	ExprAST(ExprKind Kind) : Kind(Kind) {}
 	virtual ~ExprAST() = default;
+
+	static void *operator new(size_t Size) { return ThreadNodePool->allocate(Size); }
+	static void operator delete(void *P, size_t Size) {
+		ThreadNodePool->deallocate(P, Size);
+	}
+
+	ExprKind getKind() const { return Kind; }
+
+private:
+	const ExprKind Kind;
 };
 
 class NumberExprAST : public ExprAST {
 	double Val;
 
 public:
-	NumberExprAST(double val) : Val(val) {}
+	NumberExprAST(double val) : ExprAST(EK_Number), Val(val) {}
+
+	double getVal() const { return Val; }
+
+	static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
 };
 
 
+// variables are parameters, Slot is the parameter's position once the
+// function has been resolved
 class VariableExprAST : public ExprAST {
 	std::string Name;
+	SourceLocation Loc;
+	unsigned Slot = 0;
 
 public:
-	VariableExprAST(const std::string &name) : Name(name) {}
+	VariableExprAST(const std::string &name, SourceLocation Loc = {0, 0})
+	: ExprAST(EK_Variable), Name(name), Loc(Loc) {}
+
+	const std::string &getName() const { return Name; }
+	SourceLocation getLoc() const { return Loc; }
+	unsigned getSlot() const { return Slot; }
+	void setSlot(unsigned S) { Slot = S; }
+
+	static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
 };
 
 // Expression class for binary operator
@@ -116,31 +507,80 @@ class BinaryExprAST : public ExprAST {
 public:
 	BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
 			   std::unique_ptr<ExprAST> RHS)
-	: Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+	: ExprAST(EK_Binary), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+
+	char getOp() const { return Op; }
+	const ExprAST &getLHS() const { return *LHS; }
+	const ExprAST &getRHS() const { return *RHS; }
+	ExprAST &getLHS() { return *LHS; }
+	ExprAST &getRHS() { return *RHS; }
+
+	static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
 };
 
-// Expression class for function calls
+// argument lists of calls and prototypes, inline up to the usual 0-3 entries
+typedef SmallVector<std::unique_ptr<ExprAST>, 3> ExprList;
+typedef SmallVector<std::string, 3> NameList;
+
+// Expression class for function calls, CalleeIndex is the callee's entry
+// in the function table once the caller has been resolved
 class CallExprAST : public ExprAST {
 	std::string Callee;
-	std::vector<std::unique_ptr<ExprAST>> Args;
+	ExprList Args;
+	SourceLocation Loc;
+	uint32_t CalleeIndex = 0;
+	bool Tail = false;
+
+public:
+	CallExprAST(const std::string &Callee, ExprList Args,
+		    SourceLocation Loc = {0, 0})
+	: ExprAST(EK_Call), Callee(Callee), Args(std::move(Args)), Loc(Loc) {}
+
+	const std::string &getCallee() const { return Callee; }
+	const ExprList &getArgs() const { return Args; }
+	ExprList &getArgs() { return Args; }
+	SourceLocation getLoc() const { return Loc; }
+	uint32_t getCalleeIndex() const { return CalleeIndex; }
+	void setCalleeIndex(uint32_t I) { CalleeIndex = I; }
+	// its value is the value of the function it is in
+	bool isTail() const { return Tail; }
+	void setTail(bool T) { Tail = T; }
+
+	static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+};
+
+// Expression class for if/then/else, only the chosen branch is evaluated
+class IfExprAST : public ExprAST {
+	std::unique_ptr<ExprAST> Cond, Then, Else;
 
 public:
-	CallExprAST(const std::string &Callee,
-			 std::vector<std::unique_ptr<ExprAST>> Args)
-	: Callee(Callee), Args(std::move(Args)) {}
+	IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
+		  std::unique_ptr<ExprAST> Else)
+	: ExprAST(EK_If), Cond(std::move(Cond)), Then(std::move(Then)),
+	  Else(std::move(Else)) {}
+
+	const ExprAST &getCond() const { return *Cond; }
+	const ExprAST &getThen() const { return *Then; }
+	const ExprAST &getElse() const { return *Else; }
+	ExprAST &getCond() { return *Cond; }
+	ExprAST &getThen() { return *Then; }
+	ExprAST &getElse() { return *Else; }
+
+	static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
 };
 
 // PrototypeAST - represents a protoype for a function which captures its name and 
 // its argument names 
 class PrototypeAST {
 	std::string Name;
-	std::vector<std::string> Args;
+	NameList Args;
 
 public:
-	PrototypeAST(const std::string &Name, std::vector<std::string> Args)
+	PrototypeAST(const std::string &Name, NameList Args)
 	: Name(Name), Args(std::move(Args)) {}
 
 	const std::string &getName() const {return Name; }
+	const NameList &getArgs() const { return Args; }
 };
 
 // FunctionAST - Represents a function definition
@@ -153,8 +593,67 @@ public:
 	FunctionAST(std::unique_ptr<PrototypeAST> Proto, 
 			 std::unique_ptr<ExprAST> Body)
 	: Proto(std::move(Proto)), Body(std::move(Body)) {}
+
+	const PrototypeAST &getProto() const { return *Proto; }
+	const ExprAST &getBody() const { return *Body; }
+	ExprAST &getBody() { return *Body; }
 };
 
+// isa/dyn_cast - checked downcasts using the kind tag
+template <typename T>
+bool isa(const ExprAST *E) {
+	return T::classof(E);
+}
+
+template <typename T>
+const T *dyn_cast(const ExprAST *E) {
+	return T::classof(E) ? static_cast<const T *>(E) : nullptr;
+}
+
+template <typename T>
+T *dyn_cast(ExprAST *E) {
+	return T::classof(E) ? static_cast<T *>(E) : nullptr;
+}
+
+// visit - call the overload of V for the node type of E. this is a switch on
+// the kind tag, so the compiler can turn it into a jump table and inline the
+// overloads
+template <typename Visitor>
+auto visit(const ExprAST &E, Visitor &&V)
+	-> decltype(V(static_cast<const NumberExprAST &>(E))) {
+	switch (E.getKind()) {
+		case ExprAST::EK_Number:
+			return V(static_cast<const NumberExprAST &>(E));
+		case ExprAST::EK_Variable:
+			return V(static_cast<const VariableExprAST &>(E));
+		case ExprAST::EK_Binary:
+			return V(static_cast<const BinaryExprAST &>(E));
+		case ExprAST::EK_Call:
+			return V(static_cast<const CallExprAST &>(E));
+		case ExprAST::EK_If:
+		break;
+	}
+	return V(static_cast<const IfExprAST &>(E));
+}
+
+// same for passes that annotate the tree
+template <typename Visitor>
+auto visit(ExprAST &E, Visitor &&V) -> decltype(V(static_cast<NumberExprAST &>(E))) {
+	switch (E.getKind()) {
+		case ExprAST::EK_Number:
+			return V(static_cast<NumberExprAST &>(E));
+		case ExprAST::EK_Variable:
+			return V(static_cast<VariableExprAST &>(E));
+		case ExprAST::EK_Binary:
+			return V(static_cast<BinaryExprAST &>(E));
+		case ExprAST::EK_Call:
+			return V(static_cast<CallExprAST &>(E));
+		case ExprAST::EK_If:
+		break;
+	}
+	return V(static_cast<IfExprAST &>(E));
+}
+
 }
 
 /*******************************************************************************
@@ -162,11 +661,30 @@ public:
 *******************************************************************************/
 
 // token buffer
-static int CurTok;
+// if TokPos is set, tokens are replayed from [TokPos, TokEnd) instead of being
+// read from stdin, which lets each thread parse its own slice of the input
+static thread_local int CurTok;
+static thread_local const TokenRec *TokPos = nullptr;
+static thread_local const TokenRec *TokEnd = nullptr;
+
 static int getNextToken() {
-	return CurTok = gettok();
+	if (CheckMemoryLimit())
+		return CurTok = tok_eof;
+
+	if (!TokPos)
+		return CurTok = gettok();
+
+	if (TokPos == TokEnd)
+		return CurTok = tok_eof;
+	CurLoc = TokPos->Loc;
+	if (TokPos->Tok == tok_identifier)
+		IdentifierStr = TokPos->IdentifierStr;
+	else if (TokPos->Tok == tok_number)
+		NumVal = TokPos->NumVal;
+	return CurTok = (TokPos++)->Tok;
 }
 
+// only written before parsing starts, read-only afterwards
 static std::map<char, int> BinopPrecedence;
 
 // get precedence of pending binary operator
@@ -174,23 +692,182 @@ static int GetTokPrecedence() {
 	if (!isascii(CurTok))
 		return -1;
 
-	int TokPrec = BinopPrecedence[CurTok];
-	if (TokPrec <= 0)
+	// find rather than [] so lookups never insert, parser threads share the map
+	auto It = BinopPrecedence.find(CurTok);
+	if (It == BinopPrecedence.end() || It->second <= 0)
 		return -1;
-	return TokPrec;
+	return It->second;
+}
+
+/*******************************************************************************
+* Diagnostics
+* errors are recorded as (code, location, offending token) and only formatted
+* when flushed. repeats of the same error are collapsed and parsing stops once
+* MaxErrors have been reported, so broken input can't flood the output
+*******************************************************************************/
+
+enum DiagCode {
+	diag_expected_rparen,
+	diag_expected_arg_separator,
+	diag_expected_expression,
+	diag_expected_fn_name,
+	diag_expected_proto_lparen,
+	diag_expected_proto_rparen,
+	diag_expected_then,
+	diag_expected_else,
+	diag_unknown_variable,
+	diag_too_many_registers,
+	diag_argument_count,
+	diag_too_many_extern_args,
+	diag_memory_limit,
+};
+
+// %s is replaced by the offending token
+static const char *const DiagMessages[] = {
+	"expected ')', found %s",
+	"expected ')' or ',' in argument list, found %s",
+	"unknown token when expecting an expression, found %s",
+	"expected function name in prototype, found %s",
+	"expected '(' in prototype, found %s",
+	"expected ')' in prototype, found %s",
+	"expected 'then' in if expression, found %s",
+	"expected 'else' in if expression, found %s",
+	"unknown variable name, found %s",
+	"expression needs too many registers, found %s",
+	"wrong number of arguments in call, found %s",
+	"too many parameters for an extern, found %s",
+	"item exceeds the memory limit",
+};
+
+struct Diagnostic {
+	DiagCode Code;
+	const char *File;	// null for stdin
+	SourceLocation Loc;
+	int Tok;		// token the error was reported at
+	std::string Arg;	// identifier name if Tok is tok_identifier
+	double Num;		// value if Tok is tok_number
+};
+
+// 0 means no limit
+static unsigned MaxErrors = 20;
+// how many times the same error, the same code for the same token spelled
+// the same, is shown before it is only counted
+static const unsigned MaxRepeats = 3;
+
+static std::string FormatToken(const Diagnostic &D);
+
+class DiagnosticsEngine {
+	std::vector<Diagnostic> Diags;
+	std::map<std::pair<int, std::string>, unsigned> Seen;
+	unsigned NumReported = 0;
+	unsigned NumShown = 0;
+	unsigned NumSuppressed = 0;
+
+public:
+	void report(DiagCode Code, const char *File, SourceLocation Loc, int Tok,
+		    const std::string &Ident, double Num) {
+		++NumReported;
+		Diagnostic D = {Code, File, Loc, Tok,
+				Tok == tok_identifier ? Ident : std::string(), Num};
+		if (++Seen[{Code, FormatToken(D)}] > MaxRepeats || tooManyErrors()) {
+			++NumSuppressed;
+			return;
+		}
+		++NumShown;
+		Diags.push_back(std::move(D));
+	}
+
+	// true once the error limit is hit, the parser stops at that point
+	bool tooManyErrors() const {
+		return MaxErrors && NumShown >= MaxErrors;
+	}
+
+	bool hasErrors() const { return NumReported != 0; }
+
+	// start over with the limit and the repeat counts, errors so far still
+	// count for hasErrors()
+	void reset() {
+		Seen.clear();
+		NumShown = 0;
+	}
+
+	// append the diagnostics of a later part of the same input
+	void append(DiagnosticsEngine &&Other) {
+		for (auto &D : Other.Diags)
+			report(D.Code, D.File, D.Loc, D.Tok, D.Arg, D.Num);
+		NumReported += Other.NumSuppressed;
+		NumSuppressed += Other.NumSuppressed;
+	}
+
+	// print pending diagnostics
+	void flush(FILE *Out);
+	// print what was left out, once parsing is done
+	void finish(FILE *Out);
+};
+
+static std::string FormatToken(const Diagnostic &D) {
+	char Buf[64];
+	switch (D.Tok) {
+		case tok_eof: return "end of input";
+		case tok_def: return "'def'";
+		case tok_extern: return "'extern'";
+		case tok_if: return "'if'";
+		case tok_then: return "'then'";
+		case tok_else: return "'else'";
+		case tok_identifier: return "'" + D.Arg + "'";
+		case tok_number:
+			snprintf(Buf, sizeof(Buf), "'%g'", D.Num);
+			return Buf;
+		default:
+			snprintf(Buf, sizeof(Buf), "'%c'", D.Tok);
+			return Buf;
+	}
+}
+
+void DiagnosticsEngine::flush(FILE *Out) {
+	for (auto &D : Diags) {
+		if (D.File)
+			fprintf(Out, "%s:", D.File);
+		fprintf(Out, "%d:%d: error: ", D.Loc.Line, D.Loc.Col);
+		fprintf(Out, DiagMessages[D.Code], FormatToken(D).c_str());
+		fputc('\n', Out);
+	}
+	Diags.clear();
+}
+
+void DiagnosticsEngine::finish(FILE *Out) {
+	flush(Out);
+	if (NumSuppressed)
+		fprintf(Out, "note: %u similar or excess errors not shown\n",
+			NumSuppressed);
+	if (tooManyErrors())
+		fprintf(Out, "error: too many errors emitted, stopping now\n");
+	NumSuppressed = 0;
 }
 
+// errors of the item being parsed on this thread
+static thread_local DiagnosticsEngine Diags;
+
 // LogError - Helper functions for error handling
-std::unique_ptr<ExprAST> LogError(const char* Str) {
-	fprintf(stderr, "Error: %s\n", Str);
+std::unique_ptr<ExprAST> LogError(DiagCode Code) {
+	// the parser is unwinding from a memory limit, not a syntax error
+	if (!OverMemoryLimit)
+		Diags.report(Code, InputName, CurLoc, CurTok, IdentifierStr, NumVal);
 	return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> LogErrorProto(const char* Str) {
-	LogError(Str);
+std::unique_ptr<PrototypeAST> LogErrorProto(DiagCode Code) {
+	LogError(Code);
 	return nullptr;
 }
 
+// skip the rest of a broken item, up to the next ';', 'def' or 'extern'
+static void SkipToNextItem() {
+	while (CurTok != ';' && CurTok != tok_def && CurTok != tok_extern &&
+	       CurTok != tok_eof)
+		getNextToken();
+}
+
 static std::unique_ptr<ExprAST> ParseExpression();
 
 // numberexpr ::= number
@@ -208,7 +885,7 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 		return nullptr;
 
 	if (CurTok != ')')
-		return LogError("expected ')'");
+		return LogError(diag_expected_rparen);
 
 	getNextToken();
 	return V;
@@ -218,14 +895,15 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 // returns either variable name or function name and arguments
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
 	std::string IdName = IdentifierStr;
+	SourceLocation Loc = CurLoc;
 	getNextToken();
 
 	// if there are no parethesis, it must be a variable 
 	if (CurTok != '(')
-		return std::make_unique<VariableExprAST>(IdName);
+		return std::make_unique<VariableExprAST>(IdName, Loc);
 
 	getNextToken();
-	std::vector<std::unique_ptr<ExprAST>> Args;
+	ExprList Args;
 	// add any parameters to Args vector
 	if (CurTok != ')' ) { 
 		while (true) {
@@ -238,7 +916,7 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
 				break;
 
 			if (CurTok != ',')
-				return LogError("Expected ')' or ',' in argument list");
+				return LogError(diag_expected_arg_separator);
 
 			getNextToken();
 		}
@@ -247,20 +925,90 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
 	// consume ')'
 	getNextToken();
 
-	return std::make_unique<CallExprAST>(IdName, std::move(Args));
+	return std::make_unique<CallExprAST>(IdName, std::move(Args), Loc);
 }
 
+static std::unique_ptr<ExprAST> ParseIfExpr();
+
 static std::unique_ptr<ExprAST> ParsePrimary() {
 	switch (CurTok) {
 		default:
-			return LogError("Unknown token: expected an expression");
+			return LogError(diag_expected_expression);
 		case tok_identifier:
 			return ParseIdentifierExpr();
 		case tok_number:
 			return ParseNumberExpr();
 		case '(':
 			return ParseParenExpr();
+		case tok_if:
+			return ParseIfExpr();
+	}
+}
+
+// fold constant subexpressions while parsing, set by --fold
+static bool FoldConstants = false;
+
+// apply Op to two constants. plain double arithmetic, so the result is the
+// IEEE result the operation would have at run time (as long as nobody builds
+// with -ffast-math)
+static double FoldBinOp(int Op, double L, double R) {
+	switch (Op) {
+		case '<': return L < R ? 1.0 : 0.0;
+		case '+': return L + R;
+		case '-': return L - R;
+		case '*': return L * R;
+	}
+	return 0;
+}
+
+// truth value of an if condition: anything but 0 and NaN, i.e. an ordered
+// not-equal compare against 0.0. every backend has to agree on this
+static inline bool IsTrue(double V) {
+	return V < 0.0 || V > 0.0;
+}
+
+// make a BinaryExprAST, or a single NumberExprAST when folding is on and
+// both operands are constants
+static std::unique_ptr<ExprAST> BuildBinaryExpr(int Op,
+						std::unique_ptr<ExprAST> LHS,
+						std::unique_ptr<ExprAST> RHS) {
+	if (FoldConstants) {
+		auto *L = dyn_cast<NumberExprAST>(LHS.get());
+		auto *R = dyn_cast<NumberExprAST>(RHS.get());
+		if (L && R)
+			return std::make_unique<NumberExprAST>(
+				FoldBinOp(Op, L->getVal(), R->getVal()));
 	}
+	return std::make_unique<BinaryExprAST>(Op, std::move(LHS), std::move(RHS));
+}
+
+// ifexpr ::= 'if' expression 'then' expression 'else' expression
+static std::unique_ptr<ExprAST> ParseIfExpr() {
+	getNextToken(); // eat 'if'
+	auto Cond = ParseExpression();
+	if (!Cond)
+		return nullptr;
+
+	if (CurTok != tok_then)
+		return LogError(diag_expected_then);
+	getNextToken();
+	auto Then = ParseExpression();
+	if (!Then)
+		return nullptr;
+
+	if (CurTok != tok_else)
+		return LogError(diag_expected_else);
+	getNextToken();
+	auto Else = ParseExpression();
+	if (!Else)
+		return nullptr;
+
+	// a constant condition picks its branch now
+	if (FoldConstants)
+		if (auto *C = dyn_cast<NumberExprAST>(Cond.get()))
+			return IsTrue(C->getVal()) ? std::move(Then) : std::move(Else);
+	return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
+					   std::move(Else));
 }
 
 // parse sequence of pairs
@@ -292,7 +1040,7 @@ std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LH
 				return nullptr;
 		}
 		// merge LHS and RHS
-		LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+		LHS = BuildBinaryExpr(BinOp, std::move(LHS), std::move(RHS));
 	} //loop around to top
 }
 
@@ -307,20 +1055,20 @@ static std::unique_ptr<ExprAST> ParseExpression() {
 // prototype
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
 	if (CurTok != tok_identifier)
-		return LogErrorProto("Expected function name in prototype");
+		return LogErrorProto(diag_expected_fn_name);
 
 	std::string FnName = IdentifierStr;
 	getNextToken();
 
 	if (CurTok != '(')
-		return LogErrorProto("Expected '(' in prototype");
+		return LogErrorProto(diag_expected_proto_lparen);
 
 	// read list of argument names
-	std::vector<std::string> ArgNames;
+	NameList ArgNames;
 	while (getNextToken() == tok_identifier)
 		ArgNames.push_back(IdentifierStr);
 	if (CurTok != ')')
-		return LogErrorProto("Expected ')' in prototype");
+		return LogErrorProto(diag_expected_proto_rparen);
 
 	// success
 	getNextToken(); // eat ')'
@@ -346,7 +1094,7 @@ static std::unique_ptr<FunctionAST> ParseDefinition() {
 static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
 	if (auto E = ParseExpression()) {
 		// make anonyomus prototype
-		auto Proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
+		auto Proto = std::make_unique<PrototypeAST>("", NameList());
 		return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
 	}
 	return nullptr;
@@ -359,72 +1107,5063 @@ static std::unique_ptr<PrototypeAST> ParseExtern() {
 }
 
 /*******************************************************************************
-* Top-level parsing
+* AST printer
 *******************************************************************************/
 
-static void HandleDefinition() {
-	if (ParseDefinition()) {
-		fprintf(stderr, "Parsed a function definition.\n");
-	} else {
-		// skip token for error recovery
-		getNextToken();
+// ASTPrinter - prints an expression as an s-expression, e.g. (+ x (* 2 y))
+struct ASTPrinter {
+	FILE *Out;
+
+	void operator()(const NumberExprAST &E) { fprintf(Out, "%g", E.getVal()); }
+	void operator()(const VariableExprAST &E) { fputs(E.getName().c_str(), Out); }
+
+	void operator()(const BinaryExprAST &E) {
+		fprintf(Out, "(%c ", E.getOp());
+		visit(E.getLHS(), *this);
+		fputc(' ', Out);
+		visit(E.getRHS(), *this);
+		fputc(')', Out);
 	}
-}
-static void HandleExtern() {
-	if (ParseExtern()) {
-		fprintf(stderr, "Parsed an extern.\n");
-	} else {
-		// skip token for error recovery
-		getNextToken();
+
+	void operator()(const CallExprAST &E) {
+		fprintf(Out, "(call %s", E.getCallee().c_str());
+		for (auto &Arg : E.getArgs()) {
+			fputc(' ', Out);
+			visit(*Arg, *this);
+		}
+		fputc(')', Out);
 	}
-}
-static void HandleTopLevelExpression() {
-	if (ParseTopLevelExpr()) {
-		fprintf(stderr, "Parsed a top-level expr.\n");
-	} else {
-		// skip token for error recovery
-		getNextToken();
+
+	void operator()(const IfExprAST &E) {
+		fputs("(if ", Out);
+		visit(E.getCond(), *this);
+		fputc(' ', Out);
+		visit(E.getThen(), *this);
+		fputc(' ', Out);
+		visit(E.getElse(), *this);
+		fputc(')', Out);
 	}
+};
+
+static void DumpFunction(const FunctionAST &Fn, FILE *Out) {
+	auto &Proto = Fn.getProto();
+	fprintf(Out, "  %s(", Proto.getName().c_str());
+	for (size_t I = 0; I < Proto.getArgs().size(); ++I)
+		fprintf(Out, I ? " %s" : "%s", Proto.getArgs()[I].c_str());
+	fputs(") = ", Out);
+	visit(Fn.getBody(), ASTPrinter{Out});
+	fputc('\n', Out);
 }
 
-// top = def | extern | expression | ';'
-static void MainLoop() {
-	while (true) {
-		fprintf(stderr, "> ");
-		switch (CurTok) {
-			case tok_eof:
-			return;
-			case ';': //ignore top-level semicolons
-				getNextToken();
-			break;
-			case tok_def:
-				HandleDefinition();
-			break;
-			case tok_extern:
-				HandleExtern();
-			break;
-			default:
-				HandleTopLevelExpression();
-			break;
-		}
+/*******************************************************************************
+* AST statistics
+* node counts, sizes and shape of parsed functions, for --ast-stats
+*******************************************************************************/
+
+struct ASTStats {
+	enum StatKind { sk_number, sk_variable, sk_binary, sk_call, sk_if,
+			sk_prototype, sk_function, sk_count };
+
+	size_t Nodes[sk_count] = {};
+	size_t Bytes[sk_count] = {};	// object size plus owned heap memory
+	unsigned MaxDepth = 0;
+	size_t NumCallArgs = 0;		// summed over all calls
+	size_t NameBytes = 0;		// characters in names and callees
+	size_t NumItems = 0;
+	size_t Allocs = 0;		// heap allocations made while parsing
+
+	size_t totalNodes() const;
+	size_t totalBytes() const;
+	void print(FILE *Out) const;
+};
+
+size_t ASTStats::totalNodes() const {
+	size_t N = 0;
+	for (size_t C : Nodes)
+		N += C;
+	return N;
+}
+
+size_t ASTStats::totalBytes() const {
+	size_t N = 0;
+	for (size_t B : Bytes)
+		N += B;
+	return N;
+}
+
+// heap bytes owned by a string, 0 while it fits the small string buffer
+static size_t StringHeapBytes(const std::string &S) {
+	static const size_t SmallCapacity = std::string().capacity();
+	return S.capacity() > SmallCapacity ? S.capacity() + 1 : 0;
+}
+
+// ASTStatsCollector - visitor adding one expression tree to an ASTStats
+struct ASTStatsCollector {
+	ASTStats &Stats;
+	unsigned Depth;
+
+	void add(const ExprAST &E) {
+		ASTStatsCollector Child = {Stats, Depth + 1};
+		Stats.MaxDepth = std::max(Stats.MaxDepth, Child.Depth);
+		visit(E, Child);
+	}
+
+	void operator()(const NumberExprAST &) {
+		++Stats.Nodes[ASTStats::sk_number];
+		Stats.Bytes[ASTStats::sk_number] += sizeof(NumberExprAST);
+	}
+
+	void operator()(const VariableExprAST &E) {
+		++Stats.Nodes[ASTStats::sk_variable];
+		Stats.Bytes[ASTStats::sk_variable] +=
+			sizeof(VariableExprAST) + StringHeapBytes(E.getName());
+		Stats.NameBytes += E.getName().size();
+	}
+
+	void operator()(const BinaryExprAST &E) {
+		++Stats.Nodes[ASTStats::sk_binary];
+		Stats.Bytes[ASTStats::sk_binary] += sizeof(BinaryExprAST);
+		add(E.getLHS());
+		add(E.getRHS());
+	}
+
+	void operator()(const CallExprAST &E) {
+		++Stats.Nodes[ASTStats::sk_call];
+		Stats.Bytes[ASTStats::sk_call] += sizeof(CallExprAST) +
+			StringHeapBytes(E.getCallee()) + E.getArgs().heapBytes();
+		Stats.NameBytes += E.getCallee().size();
+		Stats.NumCallArgs += E.getArgs().size();
+		for (auto &Arg : E.getArgs())
+			add(*Arg);
+	}
+
+	void operator()(const IfExprAST &E) {
+		++Stats.Nodes[ASTStats::sk_if];
+		Stats.Bytes[ASTStats::sk_if] += sizeof(IfExprAST);
+		add(E.getCond());
+		add(E.getThen());
+		add(E.getElse());
+	}
+};
+
+static void CollectASTStats(const PrototypeAST &Proto, ASTStats &Stats) {
+	++Stats.Nodes[ASTStats::sk_prototype];
+	Stats.Bytes[ASTStats::sk_prototype] += sizeof(PrototypeAST) +
+		StringHeapBytes(Proto.getName()) + Proto.getArgs().heapBytes();
+	Stats.NameBytes += Proto.getName().size();
+	for (auto &Arg : Proto.getArgs()) {
+		Stats.Bytes[ASTStats::sk_prototype] += StringHeapBytes(Arg);
+		Stats.NameBytes += Arg.size();
 	}
 }
 
+static void CollectASTStats(const FunctionAST &Fn, ASTStats &Stats) {
+	++Stats.Nodes[ASTStats::sk_function];
+	Stats.Bytes[ASTStats::sk_function] += sizeof(FunctionAST);
+	CollectASTStats(Fn.getProto(), Stats);
+	ASTStatsCollector{Stats, 0}.add(Fn.getBody());
+}
+
+void ASTStats::print(FILE *Out) const {
+	static const char *const Names[] = {"number", "variable", "binary", "call",
+					    "if", "prototype", "function"};
+	fprintf(Out, "%-10s %12s %14s\n", "kind", "nodes", "bytes");
+	for (int K = 0; K < sk_count; ++K)
+		fprintf(Out, "%-10s %12zu %14zu\n", Names[K], Nodes[K], Bytes[K]);
+	fprintf(Out, "%-10s %12zu %14zu\n", "total", totalNodes(), totalBytes());
+	fprintf(Out, "max depth: %u\n", MaxDepth);
+	fprintf(Out, "call fan-out: %.2f arguments per call\n",
+		Nodes[sk_call] ? double(NumCallArgs) / Nodes[sk_call] : 0.0);
+	fprintf(Out, "name bytes: %zu\n", NameBytes);
+	fprintf(Out, "allocations: %zu for %zu items, %.1f per item\n", Allocs,
+		NumItems, NumItems ? double(Allocs) / NumItems : 0.0);
+}
+
 /*******************************************************************************
-* Main driver code
+* Hash-consed expression DAG
+* a function body flattened into a node table where structurally identical
+* subexpressions are stored once. nodes refer to their operands by index, so
+* a subexpression that occurs many times is a single node. it is the node
+* table of AST images and what --sharing-stats measures, nothing runs from it
 *******************************************************************************/
 
-int main() {
-	// 1 is lowest precedence
-	BinopPrecedence['<'] = 10;
-	BinopPrecedence['+'] = 20;
-	BinopPrecedence['-'] = 30;
-	BinopPrecedence['*'] = 40;
+struct DAGNode {
+	enum NodeKind : uint8_t { dag_number, dag_variable, dag_binary, dag_call,
+				  dag_if };
 
-	fprintf(stderr, "> ");
-	getNextToken();
+	NodeKind Kind;
+	char Op;	// binary operator
+	uint32_t A;	// binary: LHS node. variable, call: name. if: condition
+	uint32_t B;	// binary: RHS node. call: first entry in ExprDAG::Operands.
+			// if: then node
+	uint32_t C;	// call: number of arguments. if: else node
+	double Val;	// number
+};
 
-	MainLoop();
+class ExprDAG {
+	std::vector<DAGNode> Nodes;
+	std::vector<uint32_t> Operands;
+	std::vector<std::string> Names;
+	std::unordered_map<std::string, uint32_t> NameIds;
+	// node hash to the nodes with that hash
+	std::unordered_map<uint64_t, std::vector<uint32_t>> Interned;
+	unsigned NumTreeNodes = 0;
+	// whether two equal calls of Callee may be one node
+	bool (*ShareCalls)(const std::string &Callee);
 
-	return 0;
+	uint32_t getNameId(const std::string &Name);
+	bool sameNode(const DAGNode &X, const DAGNode &Y) const;
+	uint64_t hashNode(const DAGNode &N) const;
+	uint32_t intern(const DAGNode &N, bool Pure);
+
+	friend struct DAGBuilder;
+
+public:
+	explicit ExprDAG(bool (*ShareCalls)(const std::string &))
+		: ShareCalls(ShareCalls) {}
+
+	// add an expression tree, returns the node of its root
+	uint32_t add(const ExprAST &E);
+
+	// intern a name that isn't part of an expression, e.g. a function name
+	uint32_t addName(const std::string &Name) { return getNameId(Name); }
+
+	const DAGNode &getNode(uint32_t I) const { return Nodes[I]; }
+	const uint32_t *getCallArgs(const DAGNode &N) const { return &Operands[N.B]; }
+	const std::string &getName(uint32_t I) const { return Names[I]; }
+	const std::vector<DAGNode> &getNodes() const { return Nodes; }
+	const std::vector<uint32_t> &getOperands() const { return Operands; }
+	const std::vector<std::string> &getNames() const { return Names; }
+	size_t size() const { return Nodes.size(); }
+	// nodes the added trees had before sharing
+	unsigned getNumTreeNodes() const { return NumTreeNodes; }
+};
+
+uint32_t ExprDAG::getNameId(const std::string &Name) {
+	auto It = NameIds.find(Name);
+	if (It != NameIds.end())
+		return It->second;
+	Names.push_back(Name);
+	return NameIds[Name] = Names.size() - 1;
+}
+
+uint64_t ExprDAG::hashNode(const DAGNode &N) const {
+	uint64_t H = 14695981039346656037ULL;
+	auto Mix = [&H](uint64_t V) { H = (H ^ V) * 1099511628211ULL; };
+	uint64_t Bits;
+	memcpy(&Bits, &N.Val, sizeof(Bits));
+	Mix(N.Kind);
+	Mix(uint8_t(N.Op));
+	Mix(N.A);
+	Mix(N.C);
+	Mix(Bits);
+	if (N.Kind == DAGNode::dag_call) {
+		for (uint32_t I = 0; I < N.C; ++I)
+			Mix(Operands[N.B + I]);
+	} else
+		Mix(N.B);
+	return H;
+}
+
+// numbers compare by bit pattern, so 0.0 and -0.0 stay apart
+bool ExprDAG::sameNode(const DAGNode &X, const DAGNode &Y) const {
+	if (X.Kind != Y.Kind || X.Op != Y.Op || X.A != Y.A || X.C != Y.C ||
+	    memcmp(&X.Val, &Y.Val, sizeof(X.Val)))
+		return false;
+	if (X.Kind != DAGNode::dag_call)
+		return X.B == Y.B;
+	return std::equal(&Operands[X.B], &Operands[X.B] + X.C, &Operands[Y.B]);
+}
+
+uint32_t ExprDAG::intern(const DAGNode &N, bool Pure) {
+	if (Pure) {
+		auto &Bucket = Interned[hashNode(N)];
+		for (uint32_t I : Bucket)
+			if (sameNode(Nodes[I], N)) {
+				// a shared call leaves its operand list unused, drop it
+				if (N.Kind == DAGNode::dag_call)
+					Operands.resize(N.B);
+				return I;
+			}
+		Bucket.push_back(Nodes.size());
+	}
+	Nodes.push_back(N);
+	return Nodes.size() - 1;
+}
+
+// DAGBuilder - visitor that adds one tree to an ExprDAG
+struct DAGBuilder {
+	ExprDAG &DAG;
+
+	uint32_t operator()(const NumberExprAST &E) {
+		DAGNode N = {DAGNode::dag_number, 0, 0, 0, 0, E.getVal()};
+		return DAG.intern(N, true);
+	}
+
+	uint32_t operator()(const VariableExprAST &E) {
+		DAGNode N = {DAGNode::dag_variable, 0, DAG.getNameId(E.getName()), 0, 0, 0};
+		return DAG.intern(N, true);
+	}
+
+	uint32_t operator()(const BinaryExprAST &E) {
+		uint32_t L = DAG.add(E.getLHS());
+		uint32_t R = DAG.add(E.getRHS());
+		DAGNode N = {DAGNode::dag_binary, E.getOp(), L, R, 0, 0};
+		return DAG.intern(N, true);
+	}
+
+	// operands are interned first, an operand that contains a call that isn't
+	// shared is a node of its own and so can't make two calls look the same
+	uint32_t operator()(const CallExprAST &E) {
+		std::vector<uint32_t> Args;
+		for (auto &Arg : E.getArgs())
+			Args.push_back(DAG.add(*Arg));
+		DAGNode N = {DAGNode::dag_call, 0, DAG.getNameId(E.getCallee()),
+			     uint32_t(DAG.Operands.size()), uint32_t(Args.size()), 0};
+		DAG.Operands.insert(DAG.Operands.end(), Args.begin(), Args.end());
+		return DAG.intern(N, DAG.ShareCalls(E.getCallee()));
+	}
+
+	uint32_t operator()(const IfExprAST &E) {
+		uint32_t Cond = DAG.add(E.getCond());
+		uint32_t Then = DAG.add(E.getThen());
+		uint32_t Else = DAG.add(E.getElse());
+		DAGNode N = {DAGNode::dag_if, 0, Cond, Then, Else, 0};
+		return DAG.intern(N, true);
+	}
+};
+
+uint32_t ExprDAG::add(const ExprAST &E) {
+	++NumTreeNodes;
+	return visit(E, DAGBuilder{*this});
+}
+
+/*******************************************************************************
+* Bytecode
+* a register machine. every function runs in a window of registers on the VM
+* stack, its parameters are the first registers of the window and temporaries
+* follow. a call puts its arguments in consecutive registers of the caller,
+* which become the first registers of the callee's window, so arguments are
+* never copied and no names are left at run time
+*******************************************************************************/
+
+enum Opcode : uint8_t {
+	op_const,	// R[A] = K[B]
+	op_move,	// R[A] = R[B]
+	op_add,		// R[A] = R[B] + R[C]
+	op_sub,		// R[A] = R[B] - R[C]
+	op_mul,		// R[A] = R[B] * R[C]
+	op_lt,		// R[A] = R[B] < R[C] ? 1 : 0
+	op_addk,	// R[A] = R[B] + K[C]
+	op_subk,	// R[A] = R[B] - K[C]
+	op_mulk,	// R[A] = R[B] * K[C]
+	op_ltk,		// R[A] = R[B] < K[C] ? 1 : 0
+	op_call,	// R[A] = function B called with the C arguments in R[A]...
+	op_tailcall,	// the same, replacing the running function if it can
+	op_jump,	// continue at instruction B
+	op_jump_false,	// continue at instruction B unless IsTrue(R[A])
+	op_jump_nlt,	// continue at instruction B unless R[A] < R[C]
+	op_jump_nltk,	// continue at instruction B unless R[A] < K[C]
+	op_ret,		// return R[A]
+};
+
+struct Instr {
+	Opcode Op;
+	uint16_t A;
+	uint32_t B;
+	uint32_t C;
+};
+
+// highest register a function may use
+static const unsigned MaxRegs = 0xffff;
+
+// BCFunction - the code of one function, run in a window of NumRegs
+// registers
+struct BCFunction {
+	unsigned NumRegs = 0;
+	std::vector<Instr> Code;
+	std::vector<double> Consts;
+};
+
+/*******************************************************************************
+* Function table
+* every function the program defines or declares, by index. calls are resolved
+* to an index before anything runs, so no name is looked up at run time
+*******************************************************************************/
+
+// externs are called through a switch on their parameter count
+static const unsigned MaxExternArgs = 6;
+// how deeply calls may nest, set by --max-depth. the VM keeps its calls on
+// a heap stack that grows as far as this allows
+static const unsigned DefaultMaxCallDepth = 10000;
+static unsigned MaxCallDepth = DefaultMaxCallDepth;
+// the other backends run calls on the C++ stack, and report a stack overflow
+// rather than grow it below this. null when the stack has no size limit
+static const char *NativeStackLimit = nullptr;
+// set when a run-time error stops execution, every frame returns right away
+static const char *RuntimeError = nullptr;
+
+// look up an extern in the host process, e.g. sin from libm
+static void *ResolveExtern(const std::string &Name) {
+	return dlsym(RTLD_DEFAULT, Name.c_str());
+}
+
+static double CallNative(void *Fn, const double *A, unsigned N) {
+	typedef double D;
+	switch (N) {
+		case 0: return reinterpret_cast<D (*)()>(Fn)();
+		case 1: return reinterpret_cast<D (*)(D)>(Fn)(A[0]);
+		case 2: return reinterpret_cast<D (*)(D, D)>(Fn)(A[0], A[1]);
+		case 3: return reinterpret_cast<D (*)(D, D, D)>(Fn)(A[0], A[1], A[2]);
+		case 4: return reinterpret_cast<D (*)(D, D, D, D)>(Fn)(A[0], A[1], A[2], A[3]);
+		case 5: return reinterpret_cast<D (*)(D, D, D, D, D)>(Fn)(A[0], A[1], A[2],
+									   A[3], A[4]);
+	}
+	return reinterpret_cast<D (*)(D, D, D, D, D, D)>(Fn)(A[0], A[1], A[2], A[3],
+							    A[4], A[5]);
+}
+
+// bumped whenever a function is defined, which may change what any other
+// function returns. memo tables from an older epoch are stale
+static unsigned MemoEpoch = 0;
+// entries a memo table may grow to, past that new results replace old ones
+static const size_t MaxMemoEntries = 1 << 16;
+
+// MemoTable - cached results of a pure function, keyed on the bit patterns of
+// its arguments. open addressing with linear probing. once it is full, a new
+// result overwrites the entry at its key's home slot, or is not cached if
+// that slot is free
+class MemoTable {
+	unsigned NumArgs;
+	unsigned Epoch = MemoEpoch;
+	size_t Mask = 63;
+	size_t Count = 0;
+	// per entry: NumArgs keys, then the result's bits
+	std::vector<uint64_t> Slots;
+	std::vector<bool> Used;
+
+	size_t stride() const { return NumArgs + 1; }
+	size_t hash(const double *Args) const {
+		uint64_t H = 0x9E3779B97F4A7C15ull;
+		for (unsigned I = 0; I < NumArgs; ++I) {
+			uint64_t K;
+			memcpy(&K, &Args[I], sizeof(K));
+			H = (H ^ K) * 0xBF58476D1CE4E5B9ull;
+			H ^= H >> 31;
+		}
+		return H;
+	}
+	bool matches(size_t I, const double *Args) const {
+		return !memcmp(&Slots[I * stride()], Args, NumArgs * sizeof(double));
+	}
+	void grow();
+
+public:
+	explicit MemoTable(unsigned NumArgs)
+		: NumArgs(NumArgs), Slots((Mask + 1) * stride()), Used(Mask + 1) {}
+
+	// the cached result for Args, or null
+	const double *find(const double *Args) {
+		if (Epoch != MemoEpoch)
+			clear();
+		for (size_t I = hash(Args) & Mask; Used[I]; I = (I + 1) & Mask)
+			if (matches(I, Args))
+				return reinterpret_cast<const double *>(
+					&Slots[I * stride() + NumArgs]);
+		return nullptr;
+	}
+
+	void insert(const double *Args, double Result);
+
+	void clear() {
+		Epoch = MemoEpoch;
+		Count = 0;
+		Used.assign(Used.size(), false);
+	}
+};
+
+void MemoTable::insert(const double *Args, double Result) {
+	if (Epoch != MemoEpoch)
+		clear();
+	// keep the load at or below a half
+	if (2 * (Count + 1) > Mask + 1 && (Mask + 1) < MaxMemoEntries)
+		grow();
+	size_t I = hash(Args) & Mask;
+	bool Full = 2 * (Count + 1) > Mask + 1;
+	if (Full) {
+		// full, overwrite the entry at the home slot. a free home slot is
+		// left free, so the load stays at a half and probes always end
+		if (!Used[I])
+			return;
+	} else {
+		while (Used[I])
+			I = (I + 1) & Mask;
+	}
+	memcpy(&Slots[I * stride()], Args, NumArgs * sizeof(double));
+	memcpy(&Slots[I * stride() + NumArgs], &Result, sizeof(double));
+	if (!Full) {
+		Used[I] = true;
+		++Count;
+	}
+}
+
+void MemoTable::grow() {
+	std::vector<uint64_t> OldSlots((Mask + 1) * 2 * stride());
+	std::vector<bool> OldUsed((Mask + 1) * 2);
+	OldSlots.swap(Slots);
+	OldUsed.swap(Used);
+	Mask = Mask * 2 + 1;
+	Count = 0;
+	for (size_t I = 0; I < OldUsed.size(); ++I) {
+		if (!OldUsed[I])
+			continue;
+		const uint64_t *E = &OldSlots[I * stride()];
+		double Result;
+		memcpy(&Result, &E[NumArgs], sizeof(Result));
+		insert(reinterpret_cast<const double *>(E), Result);
+	}
+}
+
+// FunctionEntry - a function of the table. definitions own their AST (--direct
+// never builds one) and their bytecode once it is compiled, externs call the
+// host function Native instead
+struct FunctionEntry {
+	std::string Name;
+	unsigned NumParams = 0;
+	bool Defined = false;
+	std::unique_ptr<FunctionAST> AST;
+	std::unique_ptr<BCFunction> BC;
+	void *Native = nullptr;
+	// what calls from JIT code jump to, with --backend=jit
+	void *JITCode = nullptr;
+	// declared by an extern, whether or not the host has it
+	bool Extern = false;
+	// with --backend=tiered, how often it was interpreted and its code once
+	// it has been compiled
+	unsigned Calls = 0;
+	void *Tiered = nullptr;
+	// calls nothing but itself and other pure functions
+	bool Pure = false;
+	// with --memoize, its cached results
+	std::unique_ptr<MemoTable> Memo;
+	// the body as written, kept once callees have been inlined into AST,
+	// and those callees
+	std::unique_ptr<FunctionAST> Source;
+	std::vector<uint32_t> Inlined;
+	// functions that inlined this one, they start over when it is redefined
+	std::vector<uint32_t> InlinedInto;
+	// functions found pure because this one was, they are checked again
+	// when it is redefined
+	std::vector<uint32_t> PureCallers;
+
+	// true once the parameter count is known
+	bool isDeclared() const { return Defined || Native; }
+};
+
+class FunctionTable {
+	std::vector<std::unique_ptr<FunctionEntry>> Functions;
+	std::unordered_map<std::string, uint32_t> Index;
+
+public:
+	// index of function Name, which is declared if it isn't known yet
+	uint32_t getIndex(const std::string &Name) {
+		auto It = Index.find(Name);
+		if (It != Index.end())
+			return It->second;
+		Functions.push_back(std::make_unique<FunctionEntry>());
+		Functions.back()->Name = Name;
+		return Index[Name] = Functions.size() - 1;
+	}
+
+	FunctionEntry &get(uint32_t I) const { return *Functions[I]; }
+	const FunctionEntry *find(const std::string &Name) const {
+		auto It = Index.find(Name);
+		return It == Index.end() ? nullptr : Functions[It->second].get();
+	}
+	size_t size() const { return Functions.size(); }
+
+	// redefining a function replaces its body, callers keep its index
+	FunctionEntry &define(const std::string &Name, unsigned NumParams) {
+		FunctionEntry &F = get(getIndex(Name));
+		F.NumParams = NumParams;
+		F.Defined = true;
+		F.AST.reset();
+		F.BC.reset();
+		F.Native = nullptr;
+		F.Calls = 0;
+		F.Tiered = nullptr;
+		F.Pure = false;
+		F.Memo.reset();
+		F.Source.reset();
+		F.Inlined.clear();
+		++MemoEpoch;
+		return F;
+	}
+	FunctionEntry &define(std::unique_ptr<FunctionAST> Fn) {
+		auto &Proto = Fn->getProto();
+		FunctionEntry &F = define(Proto.getName(), Proto.getArgs().size());
+		F.AST = std::move(Fn);
+		return F;
+	}
+
+	// an extern for a function that is defined here is just a declaration,
+	// then null is returned
+	FunctionEntry *declareExtern(const PrototypeAST &Proto) {
+		FunctionEntry &F = get(getIndex(Proto.getName()));
+		if (F.Defined)
+			return nullptr;
+		F.NumParams = Proto.getArgs().size();
+		F.Native = ResolveExtern(Proto.getName());
+		F.Extern = true;
+		return &F;
+	}
+};
+
+// functions defined by the sequential driver
+static FunctionTable Functions;
+
+// SymbolResolver - visitor that points every variable at its parameter slot
+// and every call at its function table entry. reports the first unknown
+// variable or arity mismatch and returns false
+struct SymbolResolver {
+	FunctionTable &Fns;
+	const NameList &Params;
+
+	bool operator()(NumberExprAST &) { return true; }
+
+	bool operator()(VariableExprAST &E) {
+		for (unsigned I = 0; I < Params.size(); ++I)
+			if (Params[I] == E.getName()) {
+				E.setSlot(I);
+				return true;
+			}
+		Diags.report(diag_unknown_variable, InputName, E.getLoc(),
+			     tok_identifier, E.getName(), 0);
+		return false;
+	}
+
+	bool operator()(BinaryExprAST &E) {
+		return visit(E.getLHS(), *this) && visit(E.getRHS(), *this);
+	}
+
+	// arity of a function that is already known is checked now, calls to
+	// functions that are defined later are checked when they run
+	bool operator()(CallExprAST &E) {
+		for (auto &Arg : E.getArgs())
+			if (!visit(*Arg, *this))
+				return false;
+		uint32_t I = Fns.getIndex(E.getCallee());
+		const FunctionEntry &Callee = Fns.get(I);
+		if (Callee.isDeclared() && Callee.NumParams != E.getArgs().size()) {
+			Diags.report(diag_argument_count, InputName, E.getLoc(),
+				     tok_identifier, E.getCallee(), 0);
+			return false;
+		}
+		E.setCalleeIndex(I);
+		return true;
+	}
+
+	bool operator()(IfExprAST &E) {
+		return visit(E.getCond(), *this) && visit(E.getThen(), *this) &&
+		       visit(E.getElse(), *this);
+	}
+};
+
+// mark the calls in tail position of E, the body of a function or a branch
+// of an if in tail position
+static void MarkTailCalls(ExprAST &E) {
+	if (auto *C = dyn_cast<CallExprAST>(&E)) {
+		C->setTail(true);
+	} else if (auto *If = dyn_cast<IfExprAST>(&E)) {
+		MarkTailCalls(If->getThen());
+		MarkTailCalls(If->getElse());
+	}
+}
+
+static bool ResolveFunction(FunctionTable &Fns, FunctionAST &Fn) {
+	if (!visit(Fn.getBody(), SymbolResolver{Fns, Fn.getProto().getArgs()}))
+		return false;
+	// a top-level expression runs once, leave its frame to its callees
+	if (!Fn.getProto().getName().empty())
+		MarkTailCalls(Fn.getBody());
+	return true;
+}
+
+// PurityCheck - visitor telling whether a resolved body calls only Self and
+// functions already known to be pure, and whether it calls Self other than
+// in tail position. the other functions it calls are collected in Callees
+struct PurityCheck {
+	const FunctionTable &Fns;
+	const FunctionEntry &Self;
+	bool Recursive = false;
+	std::vector<uint32_t> Callees;
+
+	PurityCheck(const FunctionTable &Fns, const FunctionEntry &Self)
+	    : Fns(Fns), Self(Self) {}
+
+	bool operator()(const NumberExprAST &) { return true; }
+	bool operator()(const VariableExprAST &) { return true; }
+	bool operator()(const BinaryExprAST &E) {
+		return visit(E.getLHS(), *this) && visit(E.getRHS(), *this);
+	}
+	bool operator()(const CallExprAST &E) {
+		const FunctionEntry &Callee = Fns.get(E.getCalleeIndex());
+		if (&Callee == &Self)
+			Recursive |= !E.isTail();
+		else if (!Callee.Pure)
+			return false;
+		else
+			Callees.push_back(E.getCalleeIndex());
+		for (auto &Arg : E.getArgs())
+			if (!visit(*Arg, *this))
+				return false;
+		return true;
+	}
+	bool operator()(const IfExprAST &E) {
+		return visit(E.getCond(), *this) && visit(E.getThen(), *this) &&
+		       visit(E.getElse(), *this);
+	}
+};
+
+// memoize every pure recursive function, set by --memoize. recursion only in
+// tail position is a loop and left alone
+static bool MemoizeRecursive = false;
+// and these whatever they call, set by --memoize=name,...
+static std::set<std::string> MemoizeNames;
+
+// work out whether a defined function is pure and give it a memo table if it
+// should have one
+static void SetUpMemo(FunctionTable &Fns, FunctionEntry &F) {
+	PurityCheck Check(Fns, F);
+	F.Pure = visit(F.AST->getBody(), Check);
+	uint32_t Index = Fns.getIndex(F.Name);
+	for (uint32_t I : F.Pure ? Check.Callees : std::vector<uint32_t>()) {
+		auto &By = Fns.get(I).PureCallers;
+		if (std::find(By.begin(), By.end(), Index) == By.end())
+			By.push_back(Index);
+	}
+	if (MemoizeNames.count(F.Name) || (MemoizeRecursive && F.Pure && Check.Recursive))
+		F.Memo = std::make_unique<MemoTable>(F.NumParams);
+}
+
+/*******************************************************************************
+* Inliner
+* replaces calls to small functions that don't recurse with the callee's body,
+* before a definition reaches any backend. the language has no local
+* variables, so an argument is only substituted for its parameter where that
+* can't change what gets evaluated
+*******************************************************************************/
+
+// inline calls, cleared by --no-inline
+static bool InlineCalls = true;
+// how many nodes a callee, with its arguments substituted, may have to be
+// inlined at a call site that runs on every call of its caller. a recursive
+// function runs more often and gets twice that. each enclosing branch of an
+// if halves it, except in a recursive function the branch that recurses,
+// which is the one that runs over and over
+static const unsigned InlineBudget = 16;
+// a body stops taking in callees once it has grown to this many nodes
+static const unsigned MaxInlinedNodes = 256;
+
+// ExprScan - visitor measuring a resolved expression: its nodes, the uses of
+// each parameter and the calls it makes, to Target in particular
+struct ExprScan {
+	uint32_t Target;
+	unsigned Nodes = 0;
+	unsigned Calls = 0;
+	unsigned TargetCalls = 0;
+	SmallVector<unsigned, 3> Uses;
+
+	explicit ExprScan(uint32_t Target) : Target(Target) {}
+
+	void operator()(const NumberExprAST &) { ++Nodes; }
+	void operator()(const VariableExprAST &E) {
+		++Nodes;
+		while (Uses.size() <= E.getSlot())
+			Uses.push_back(0);
+		++Uses[E.getSlot()];
+	}
+	void operator()(const BinaryExprAST &E) {
+		++Nodes;
+		visit(E.getLHS(), *this);
+		visit(E.getRHS(), *this);
+	}
+	void operator()(const CallExprAST &E) {
+		++Nodes;
+		++Calls;
+		TargetCalls += E.getCalleeIndex() == Target;
+		for (auto &Arg : E.getArgs())
+			visit(*Arg, *this);
+	}
+	void operator()(const IfExprAST &E) {
+		++Nodes;
+		visit(E.getCond(), *this);
+		visit(E.getThen(), *this);
+		visit(E.getElse(), *this);
+	}
+
+	unsigned uses(unsigned Slot) const { return Slot < Uses.size() ? Uses[Slot] : 0; }
+};
+
+// ExprCopier - visitor copying a resolved expression. with Args, parameter I
+// is replaced by a copy of *Args[I], and with --fold the constants that meet
+// are folded as the parser would
+struct ExprCopier {
+	const ExprAST *const *Args;
+
+	std::unique_ptr<ExprAST> operator()(const NumberExprAST &E) {
+		return std::make_unique<NumberExprAST>(E.getVal());
+	}
+	std::unique_ptr<ExprAST> operator()(const VariableExprAST &E) {
+		if (Args)
+			return visit(*Args[E.getSlot()], ExprCopier{nullptr});
+		auto V = std::make_unique<VariableExprAST>(E.getName(), E.getLoc());
+		V->setSlot(E.getSlot());
+		return V;
+	}
+	std::unique_ptr<ExprAST> operator()(const BinaryExprAST &E) {
+		auto LHS = visit(E.getLHS(), *this);
+		return BuildBinaryExpr(E.getOp(), std::move(LHS), visit(E.getRHS(), *this));
+	}
+	std::unique_ptr<ExprAST> operator()(const CallExprAST &E) {
+		ExprList Args;
+		for (auto &Arg : E.getArgs())
+			Args.push_back(visit(*Arg, *this));
+		auto C = std::make_unique<CallExprAST>(E.getCallee(), std::move(Args),
+						       E.getLoc());
+		C->setCalleeIndex(E.getCalleeIndex());
+		return C;
+	}
+	std::unique_ptr<ExprAST> operator()(const IfExprAST &E) {
+		auto Cond = visit(E.getCond(), *this);
+		auto Then = visit(E.getThen(), *this);
+		auto Else = visit(E.getElse(), *this);
+		if (FoldConstants)
+			if (auto *C = dyn_cast<NumberExprAST>(Cond.get()))
+				return IsTrue(C->getVal()) ? std::move(Then) : std::move(Else);
+		return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
+						   std::move(Else));
+	}
+};
+
+// Inliner - visitor copying the body of Caller with the calls that are worth
+// it replaced by their callee's body
+struct Inliner {
+	const FunctionTable &Fns;
+	uint32_t Caller;
+	unsigned Budget;
+	// nodes in the copy so far, roughly, and the callees that went in
+	unsigned &Size;
+	std::vector<uint32_t> &Inlined;
+
+	std::unique_ptr<ExprAST> operator()(const NumberExprAST &E) {
+		return ExprCopier{nullptr}(E);
+	}
+	std::unique_ptr<ExprAST> operator()(const VariableExprAST &E) {
+		return ExprCopier{nullptr}(E);
+	}
+	std::unique_ptr<ExprAST> operator()(const BinaryExprAST &E) {
+		auto LHS = visit(E.getLHS(), *this);
+		return BuildBinaryExpr(E.getOp(), std::move(LHS), visit(E.getRHS(), *this));
+	}
+
+	std::unique_ptr<ExprAST> operator()(const CallExprAST &E) {
+		ExprList Args;
+		for (auto &Arg : E.getArgs())
+			Args.push_back(visit(*Arg, *this));
+		if (auto Body = inlineCall(E, Args))
+			return Body;
+		auto C = std::make_unique<CallExprAST>(E.getCallee(), std::move(Args),
+						       E.getLoc());
+		C->setCalleeIndex(E.getCalleeIndex());
+		return C;
+	}
+
+	std::unique_ptr<ExprAST> operator()(const IfExprAST &E) {
+		auto Cond = visit(E.getCond(), *this);
+		auto Then = visit(E.getThen(), branch(E.getThen()));
+		auto Else = visit(E.getElse(), branch(E.getElse()));
+		if (FoldConstants)
+			if (auto *C = dyn_cast<NumberExprAST>(Cond.get()))
+				return IsTrue(C->getVal()) ? std::move(Then) : std::move(Else);
+		return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
+						   std::move(Else));
+	}
+
+	Inliner branch(const ExprAST &E) const {
+		ExprScan Scan(Caller);
+		visit(E, Scan);
+		Inliner Branch = *this;
+		if (!Scan.TargetCalls)
+			Branch.Budget /= 2;
+		return Branch;
+	}
+
+	// the callee's body with Args substituted, null if the call stays
+	std::unique_ptr<ExprAST> inlineCall(const CallExprAST &E, const ExprList &Args) {
+		uint32_t Index = E.getCalleeIndex();
+		const FunctionEntry &Callee = Fns.get(Index);
+		// a memoized callee has to be called to use its table
+		if (Index == Caller || !Callee.AST || Callee.Memo ||
+		    Callee.NumParams != Args.size())
+			return nullptr;
+		ExprScan Scan(Index);
+		visit(Callee.AST->getBody(), Scan);
+		if (Scan.Nodes > Budget)
+			return nullptr;
+		// a body calling Caller would make Caller recursive
+		ExprScan Cycle(Caller);
+		visit(Callee.AST->getBody(), Cycle);
+		if (Scan.TargetCalls || Cycle.TargetCalls)
+			return nullptr;
+
+		// an argument is evaluated once, before the body. one that calls
+		// nothing can't fail or have an effect, so it can be evaluated
+		// where its parameter is used instead, or not at all. it is only
+		// repeated if it is a number or a variable, so the inlined body
+		// never does more work than the call
+		SmallVector<const ExprAST *, 3> Subst;
+		unsigned Nodes = Scan.Nodes;
+		for (unsigned I = 0; I < Args.size(); ++I) {
+			ExprScan ArgScan(Index);
+			visit(*Args[I], ArgScan);
+			if (ArgScan.Calls || (ArgScan.Nodes > 1 && Scan.uses(I) > 1))
+				return nullptr;
+			Nodes += (ArgScan.Nodes - 1) * Scan.uses(I);
+			Subst.push_back(Args[I].get());
+		}
+		if (Nodes > Budget || Size + Nodes > MaxInlinedNodes)
+			return nullptr;
+
+		Size += Nodes;
+		for (uint32_t I : Callee.Inlined)
+			addInlined(I);
+		addInlined(Index);
+		return visit(Callee.AST->getBody(), ExprCopier{Subst.begin()});
+	}
+
+	void addInlined(uint32_t I) {
+		if (std::find(Inlined.begin(), Inlined.end(), I) == Inlined.end())
+			Inlined.push_back(I);
+	}
+};
+
+// inline what is worth it into the resolved definition F. its body as written
+// is kept in Source, and F is registered with every callee that went in
+static void InlineFunction(FunctionTable &Fns, FunctionEntry &F) {
+	if (!InlineCalls || !F.AST)
+		return;
+	uint32_t Index = Fns.getIndex(F.Name);
+	ExprScan Scan(Index);
+	visit(F.AST->getBody(), Scan);
+	// nothing to do for leaves, which is most of the small functions worth
+	// inlining themselves
+	if (!Scan.Calls || Scan.Nodes >= MaxInlinedNodes)
+		return;
+
+	unsigned Size = Scan.Nodes;
+	std::vector<uint32_t> Inlined;
+	unsigned Budget = Scan.TargetCalls ? 2 * InlineBudget : InlineBudget;
+	auto Body = visit(F.AST->getBody(), Inliner{Fns, Index, Budget, Size, Inlined});
+	if (Inlined.empty())
+		return;
+
+	MarkTailCalls(*Body);
+	auto &Proto = F.AST->getProto();
+	auto Copy = std::make_unique<PrototypeAST>(Proto.getName(), Proto.getArgs());
+	F.Source = std::move(F.AST);
+	F.AST = std::make_unique<FunctionAST>(std::move(Copy), std::move(Body));
+	F.Inlined = std::move(Inlined);
+	for (uint32_t I : F.Inlined) {
+		auto &Into = Fns.get(I).InlinedInto;
+		if (std::find(Into.begin(), Into.end(), Index) == Into.end())
+			Into.push_back(Index);
+	}
+}
+
+/*******************************************************************************
+* Evaluator
+* runs resolved functions straight from their ASTs. this is the baseline the
+* other backends are measured against: dispatch is the switch in visit(),
+* variables are read from their slot and calls go to the table by index. it
+* doesn't recurse, the nodes and calls in progress are kept on stacks on the
+* heap, so how deep calls nest is only limited by MaxCallDepth
+*******************************************************************************/
+
+static double CallFunction(const FunctionTable &Fns, FunctionEntry &F,
+			   const double *Args, unsigned NumArgs, unsigned Depth);
+
+static bool NativeStackExhausted() {
+	return static_cast<const char *>(__builtin_frame_address(0)) < NativeStackLimit;
+}
+
+// what is left of the C++ stack below the deepest checked call, for externs
+// and libc, and above main for the environment
+static const size_t NativeStackReserve = 256 << 10;
+
+// for running on the stack main was given, called close enough to its top.
+// only one thread runs programs
+static void InitNativeStackLimit() {
+	struct rlimit Limit;
+	if (getrlimit(RLIMIT_STACK, &Limit) || Limit.rlim_cur == RLIM_INFINITY ||
+	    Limit.rlim_cur < 2 * NativeStackReserve)
+		return;
+	NativeStackLimit = static_cast<const char *>(__builtin_frame_address(0)) -
+			   (Limit.rlim_cur - NativeStackReserve);
+}
+
+// compiled code makes its calls on the C++ stack, and so do calls that go
+// from compiled code through the evaluator or the VM. at most about this
+// many bytes each
+static const size_t ProgramFrameBytes = 512;
+
+// the stack everything after the options runs on: as much as main was given,
+// plus room for MaxCallDepth such calls. pages are only backed by memory once
+// used
+static size_t ProgramStackSize;
+static int (*ProgramMain)();
+static int ProgramStatus;
+
+static void *StartProgram(void *) {
+	NativeStackLimit = static_cast<const char *>(__builtin_frame_address(0)) -
+			   (ProgramStackSize - NativeStackReserve);
+	ProgramStatus = ProgramMain();
+	return nullptr;
+}
+
+// call Main on a thread with a program stack and return what it returns. on
+// the calling thread if one can't be started
+static int RunOnProgramStack(int (*Main)()) {
+	const size_t Page = 4096;
+	size_t Size = size_t(MaxCallDepth) * ProgramFrameBytes + NativeStackReserve;
+	struct rlimit Limit;
+	if (!getrlimit(RLIMIT_STACK, &Limit) && Limit.rlim_cur != RLIM_INFINITY)
+		Size += Limit.rlim_cur;
+	ProgramStackSize = (Size + Page - 1) & ~(Page - 1);
+	ProgramMain = Main;
+	pthread_attr_t Attr;
+	pthread_t Thread;
+	bool Started = !pthread_attr_init(&Attr) &&
+		       !pthread_attr_setstacksize(&Attr, ProgramStackSize) &&
+		       !pthread_create(&Thread, &Attr, StartProgram, nullptr);
+	pthread_attr_destroy(&Attr);
+	if (!Started) {
+		InitNativeStackLimit();
+		return Main();
+	}
+	pthread_join(Thread, nullptr);
+	return ProgramStatus;
+}
+
+// with --backend=tiered, how often a function is interpreted before it is
+// compiled. 0 never compiles
+static const unsigned DefaultTierUpCalls = 100;
+static unsigned TierUpCalls = DefaultTierUpCalls;
+
+#ifdef CHALICE_HAVE_JIT
+static bool TierUp(FunctionEntry &F);
+static double CallTiered(const FunctionEntry &F, const double *Args, unsigned Depth);
+#endif
+
+// a node being evaluated and how many of its operands are done, their values
+// are on top of EvalValues
+struct EvalTask {
+	const ExprAST *E;
+	unsigned Done;
+};
+
+// a call being evaluated. its arguments are EvalValues[Args...] and its
+// tasks start at EvalTasks[Tasks]
+struct EvalFrame {
+	FunctionEntry *F;	// null for a top-level expression
+	size_t Args;
+	size_t Tasks;
+};
+
+// the evaluator's stacks. an evaluation entered again, e.g. from compiled
+// code, works above the entries of the one it was entered from
+static std::vector<EvalTask> EvalTasks;
+static std::vector<double> EvalValues;
+static std::vector<EvalFrame> EvalFrames;
+
+// Evaluator - visitor taking the task on top of EvalTasks one step further.
+// it runs until the frame EvalFrames[Base], a call at depth Depth, returns
+struct Evaluator {
+	const FunctionTable &Fns;
+	size_t Base;
+	unsigned Depth;
+
+	void push(const ExprAST &E) { EvalTasks.push_back({&E, 0}); }
+	double pop() {
+		double V = EvalValues.back();
+		EvalValues.pop_back();
+		return V;
+	}
+	// the task on top is done and has the value V
+	void done(double V) {
+		EvalTasks.pop_back();
+		EvalValues.push_back(V);
+	}
+
+	// the value of a number or a variable, false for anything else
+	bool leaf(const ExprAST &E, double &V) {
+		if (auto *N = dyn_cast<NumberExprAST>(&E))
+			V = N->getVal();
+		else if (auto *Var = dyn_cast<VariableExprAST>(&E))
+			V = EvalValues[EvalFrames.back().Args + Var->getSlot()];
+		else
+			return false;
+		return true;
+	}
+	// the value of a leaf or an operator on two of them, which need no task
+	// of their own. false for anything else
+	bool quick(const ExprAST &E, double &V) {
+		if (leaf(E, V))
+			return true;
+		auto *B = dyn_cast<BinaryExprAST>(&E);
+		double L, R;
+		if (!B || !leaf(B->getLHS(), L) || !leaf(B->getRHS(), R))
+			return false;
+		V = FoldBinOp(B->getOp(), L, R);
+		return true;
+	}
+	// put the value of an operand on top of EvalValues if it is quick, and
+	// return true. otherwise push a task for it
+	bool operand(const ExprAST &E) {
+		double V;
+		if (!quick(E, V)) {
+			push(E);
+			return false;
+		}
+		EvalValues.push_back(V);
+		return true;
+	}
+
+	void operator()(const NumberExprAST &E) { done(E.getVal()); }
+	void operator()(const VariableExprAST &E) {
+		done(EvalValues[EvalFrames.back().Args + E.getSlot()]);
+	}
+
+	void operator()(const BinaryExprAST &E) {
+		switch (EvalTasks.back().Done++) {
+			case 0:
+				if (!operand(E.getLHS()))
+					return;
+				EvalTasks.back().Done++;
+				// fall through
+			case 1:
+				if (!operand(E.getRHS()))
+					return;
+		}
+		double R = pop();
+		double L = pop();
+		done(FoldBinOp(E.getOp(), L, R));
+	}
+
+	void operator()(const CallExprAST &E) {
+		auto &Args = E.getArgs();
+		for (unsigned &I = EvalTasks.back().Done; I < Args.size();)
+			if (!operand(*Args[I++]))
+				return;
+		EvalTasks.pop_back();
+		FunctionEntry &Callee = Fns.get(E.getCalleeIndex());
+		size_t At = EvalValues.size() - Args.size();
+		// a call in tail position takes over its caller's frame, so tail
+		// recursion runs in constant space. not from a memoized caller,
+		// which still has to cache its result, or a top-level expression
+		EvalFrame &Caller = EvalFrames.back();
+		if (E.isTail() && Caller.F && !Caller.F->Memo) {
+			std::copy(EvalValues.begin() + At, EvalValues.end(),
+				  EvalValues.begin() + Caller.Args);
+			EvalValues.resize(Caller.Args + Args.size());
+			return enter(Callee, Caller.Args, Args.size(), true);
+		}
+		enter(Callee, At, Args.size(), false);
+	}
+
+	void operator()(const IfExprAST &E) {
+		double Cond;
+		if (EvalTasks.back().Done++ == 0) {
+			if (!quick(E.getCond(), Cond))
+				return push(E.getCond());
+		} else
+			Cond = pop();
+		// the branch replaces the if, so a call in it stays in tail position
+		EvalTasks.back() = {IsTrue(Cond) ? &E.getThen() : &E.getElse(), 0};
+	}
+
+	// call F with the NumArgs arguments at EvalValues[At...], in the frame on
+	// top if Replace. a call that doesn't get a frame, e.g. to an extern,
+	// leaves its value in place of the arguments
+	void enter(FunctionEntry &F, size_t At, unsigned NumArgs, bool Replace) {
+		unsigned D = Depth + (EvalFrames.size() - Base) - Replace;
+		const double *Args = EvalValues.data() + At;
+		double Result;
+		if (F.Native && NumArgs <= MaxExternArgs)
+			Result = CallNative(F.Native, Args, NumArgs);
+		else if (!F.AST)
+			return void(RuntimeError = "call to undefined function");
+		else if (NumArgs != F.NumParams)
+			return void(RuntimeError = "wrong number of arguments in call");
+		else if (D > MaxCallDepth)
+			return void(RuntimeError = "stack overflow");
+		else if (const double *Hit = F.Memo ? F.Memo->find(Args) : nullptr)
+			Result = *Hit;
+#ifdef CHALICE_HAVE_JIT
+		// hot functions run as native code from then on
+		else if (!F.Memo && (F.Tiered || (TierUpCalls &&
+			 ++F.Calls == TierUpCalls && TierUp(F))))
+			Result = CallTiered(F, Args, D);
+#endif
+		else {
+			if (Replace)
+				EvalFrames.back().F = &F;
+			else
+				EvalFrames.push_back({&F, At, EvalTasks.size()});
+			return push(F.AST->getBody());
+		}
+		EvalValues.resize(At);
+		EvalValues.push_back(Result);
+	}
+
+	// take steps until the frame at Base returns, with its value or 0 after
+	// a run-time error. everything it calls is inlined into its loop but
+	// tiering up, which stays out of line
+	__attribute__((flatten)) double run() {
+		while (!RuntimeError) {
+			EvalFrame &Frame = EvalFrames.back();
+			if (EvalTasks.size() > Frame.Tasks) {
+				visit(*EvalTasks.back().E, *this);
+				continue;
+			}
+			// its body has its value
+			double Result = EvalValues.back();
+			if (Frame.F && Frame.F->Memo)
+				Frame.F->Memo->insert(EvalValues.data() + Frame.Args, Result);
+			EvalValues.resize(Frame.Args);
+			EvalFrames.pop_back();
+			if (EvalFrames.size() == Base)
+				return Result;
+			EvalValues.push_back(Result);
+		}
+		EvalTasks.resize(EvalFrames[Base].Tasks);
+		EvalValues.resize(EvalFrames[Base].Args);
+		EvalFrames.resize(Base);
+		return 0;
+	}
+};
+
+// call F from outside the evaluator, e.g. from the VM or compiled code
+static double CallFunction(const FunctionTable &Fns, FunctionEntry &F,
+			   const double *Args, unsigned NumArgs, unsigned Depth) {
+	// each entry from compiled code takes C++ stack
+	if (NativeStackExhausted()) {
+		RuntimeError = "stack overflow";
+		return 0;
+	}
+	size_t At = EvalValues.size();
+	EvalValues.insert(EvalValues.end(), Args, Args + NumArgs);
+	Evaluator E = {Fns, EvalFrames.size(), Depth};
+	E.enter(F, At, NumArgs, false);
+	if (EvalFrames.size() > E.Base)
+		return E.run();
+	double Result = RuntimeError ? 0 : EvalValues.back();
+	EvalValues.resize(At);
+	return Result;
+}
+
+// evaluate a function of no arguments, e.g. a top-level expression. on
+// run-time errors returns false and sets Err
+static bool Evaluate(const FunctionTable &Fns, const FunctionAST &Fn,
+		     double *Result, const char **Err) {
+	RuntimeError = nullptr;
+	Evaluator E = {Fns, EvalFrames.size(), 0};
+	EvalFrames.push_back({nullptr, EvalValues.size(), EvalTasks.size()});
+	E.push(Fn.getBody());
+	*Result = E.run();
+	*Err = RuntimeError;
+	return !RuntimeError;
+}
+
+/*******************************************************************************
+* Bytecode VM
+* dispatches with computed goto where the compiler has it: every handler ends
+* in its own indirect jump to the next one, which predicts far better than the
+* single jump of a switch. -DCHALICE_NO_COMPUTED_GOTO forces the switch
+*******************************************************************************/
+
+#if defined(__GNUC__) && !defined(CHALICE_NO_COMPUTED_GOTO)
+#define CHALICE_COMPUTED_GOTO 1
+#endif
+
+// calls between bytecode functions don't recurse on the C++ stack, the VM
+// keeps the caller's state in a frame instead. the frame of the call at
+// depth D is VMFrames[D], so an Execute that is entered again from somewhere
+// else (e.g. through the evaluator) starts above the frames in use
+struct VMFrame {
+	const BCFunction *Fn;
+	const Instr *RetPC;	// the caller continues here, after its op_call
+	size_t R;		// the caller's registers, from the stack's start
+};
+
+// registers of all active calls, in doubles, and their frames. both are
+// contiguous on the heap and double when a call doesn't fit, the frames up
+// to MaxCallDepth, so deep recursion costs memory rather than C++ stack
+static const size_t VMInitialStack = 1 << 16;
+static const size_t VMInitialFrames = 1 << 10;
+static std::vector<double> VMStack;
+static std::vector<VMFrame> VMFrames;
+
+// make room for NumFrames frames and NumRegs registers. the stacks may move
+static void GrowVMStacks(size_t NumFrames, size_t NumRegs) {
+	size_t N = VMStack.size();
+	while (N < NumRegs)
+		N *= 2;
+	VMStack.resize(N);
+	N = VMFrames.size();
+	while (N < NumFrames)
+		N *= 2;
+	VMFrames.resize(std::max<size_t>(NumFrames, std::min<size_t>(N, MaxCallDepth)));
+}
+
+static double Execute(const FunctionTable &M, const BCFunction &Entry, double *R,
+		      unsigned Depth) {
+	double *Stack = VMStack.data();
+	const double *StackEnd = Stack + VMStack.size();
+	VMFrame *Frames = VMFrames.data();
+	VMFrame *FrameEnd = Frames + VMFrames.size();
+	VMFrame *Frame = Frames + Depth;
+	const BCFunction *Fn = &Entry;
+	const Instr *Code = Fn->Code.data();
+	const Instr *PC = Code;
+	const double *K = Fn->Consts.data();
+	const Instr *I;
+
+	// make room for NumFrames more frames and NumRegs registers from R,
+	// then point back into the stacks wherever they moved to
+#define VM_GROW(NumFrames, NumRegs)						\
+	do {									\
+		size_t FrameAt = Frame - Frames, RAt = R - Stack;		\
+		GrowVMStacks(FrameAt + (NumFrames), RAt + (NumRegs));		\
+		Stack = VMStack.data();						\
+		StackEnd = Stack + VMStack.size();				\
+		Frames = VMFrames.data();					\
+		FrameEnd = Frames + VMFrames.size();				\
+		Frame = Frames + FrameAt;					\
+		R = Stack + RAt;						\
+	} while (0)
+
+#ifdef CHALICE_COMPUTED_GOTO
+	// in Opcode order
+	static const void *const Labels[] = {
+		&&L_op_const, &&L_op_move, &&L_op_add, &&L_op_sub, &&L_op_mul,
+		&&L_op_lt, &&L_op_addk, &&L_op_subk, &&L_op_mulk, &&L_op_ltk,
+		&&L_op_call, &&L_op_tailcall, &&L_op_jump, &&L_op_jump_false, &&L_op_jump_nlt,
+		&&L_op_jump_nltk, &&L_op_ret,
+	};
+	static_assert(sizeof(Labels) / sizeof(Labels[0]) == op_ret + 1,
+		      "a label is missing for an opcode");
+#define VM_DISPATCH() goto *Labels[(I = PC++)->Op];
+#define VM_CASE(Op) L_##Op
+#define VM_NEXT() VM_DISPATCH()
+#else
+#define VM_DISPATCH() I = PC++; switch (I->Op)
+#define VM_CASE(Op) case Op
+#define VM_NEXT() continue
+#endif
+
+	while (true) {
+		VM_DISPATCH() {
+			VM_CASE(op_const): R[I->A] = K[I->B]; VM_NEXT();
+			VM_CASE(op_move): R[I->A] = R[I->B]; VM_NEXT();
+			VM_CASE(op_add): R[I->A] = R[I->B] + R[I->C]; VM_NEXT();
+			VM_CASE(op_sub): R[I->A] = R[I->B] - R[I->C]; VM_NEXT();
+			VM_CASE(op_mul): R[I->A] = R[I->B] * R[I->C]; VM_NEXT();
+			VM_CASE(op_lt): R[I->A] = R[I->B] < R[I->C] ? 1.0 : 0.0; VM_NEXT();
+			VM_CASE(op_addk): R[I->A] = R[I->B] + K[I->C]; VM_NEXT();
+			VM_CASE(op_subk): R[I->A] = R[I->B] - K[I->C]; VM_NEXT();
+			VM_CASE(op_mulk): R[I->A] = R[I->B] * K[I->C]; VM_NEXT();
+			VM_CASE(op_ltk): R[I->A] = R[I->B] < K[I->C] ? 1.0 : 0.0; VM_NEXT();
+			VM_CASE(op_call): {
+				FunctionEntry &Callee = M.get(I->B);
+				if (Callee.BC && I->C == Callee.NumParams) {
+					if (Frame == FrameEnd ||
+					    Callee.BC->NumRegs > size_t(StackEnd - (R + I->A))) {
+						// the frames stop growing at MaxCallDepth
+						if (Frame - Frames >= MaxCallDepth) {
+							RuntimeError = "stack overflow";
+							return 0;
+						}
+						VM_GROW(1, I->A + Callee.BC->NumRegs);
+					}
+					*Frame++ = {Fn, PC, size_t(R - Stack)};
+					Fn = Callee.BC.get();
+					Code = PC = Fn->Code.data();
+					K = Fn->Consts.data();
+					R += I->A;
+					VM_NEXT();
+				}
+				// externs, errors and functions that weren't compiled
+				R[I->A] = CallFunction(M, Callee, R + I->A, I->C,
+						       Frame - Frames + 1);
+				if (RuntimeError)
+					return 0;
+				VM_NEXT();
+			}
+			VM_CASE(op_tailcall): {
+				// the arguments become the parameters of the
+				// callee, which runs in this frame
+				FunctionEntry &Callee = M.get(I->B);
+				if (Callee.BC && I->C == Callee.NumParams) {
+					if (Callee.BC->NumRegs > size_t(StackEnd - R))
+						VM_GROW(0, Callee.BC->NumRegs);
+					memmove(R, R + I->A, I->C * sizeof(double));
+					Fn = Callee.BC.get();
+					Code = PC = Fn->Code.data();
+					K = Fn->Consts.data();
+					VM_NEXT();
+				}
+				// a plain call, the op_ret after it returns
+				R[I->A] = CallFunction(M, Callee, R + I->A, I->C,
+						       Frame - Frames + 1);
+				if (RuntimeError)
+					return 0;
+				VM_NEXT();
+			}
+			VM_CASE(op_jump):
+				PC = Code + I->B;
+				VM_NEXT();
+			VM_CASE(op_jump_false):
+				if (!IsTrue(R[I->A]))
+					PC = Code + I->B;
+				VM_NEXT();
+			VM_CASE(op_jump_nlt):
+				if (!(R[I->A] < R[I->C]))
+					PC = Code + I->B;
+				VM_NEXT();
+			VM_CASE(op_jump_nltk):
+				if (!(R[I->A] < K[I->C]))
+					PC = Code + I->B;
+				VM_NEXT();
+			VM_CASE(op_ret): {
+				double Result = R[I->A];
+				if (Frame == Frames + Depth)
+					return Result;
+				--Frame;
+				Fn = Frame->Fn;
+				Code = Fn->Code.data();
+				PC = Frame->RetPC;
+				K = Fn->Consts.data();
+				R = Stack + Frame->R;
+				R[PC[-1].A] = Result;
+				VM_NEXT();
+			}
+		}
+	}
+#undef VM_GROW
+#undef VM_DISPATCH
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+// run a function of no arguments, e.g. a top-level expression. on run-time
+// errors returns false and sets Err
+static bool RunBytecode(const FunctionTable &M, const BCFunction &Fn,
+			double *Result, const char **Err) {
+	if (VMStack.empty()) {
+		VMStack.resize(VMInitialStack);
+		VMFrames.resize(std::min<size_t>(VMInitialFrames, MaxCallDepth));
+	}
+	if (Fn.NumRegs > VMStack.size())
+		GrowVMStacks(0, Fn.NumRegs);
+	RuntimeError = nullptr;
+	*Result = Execute(M, Fn, VMStack.data(), 0);
+	*Err = RuntimeError;
+	return !RuntimeError;
+}
+
+/*******************************************************************************
+* Bytecode compiler
+* lowers a resolved FunctionAST to bytecode, with the same register discipline
+* as the direct emitter below: a node gets the first free register Dst, may
+* use it and anything above as scratch, and returns the register holding its
+* value. parameters are registers 0..N-1, so variables compile to nothing
+*******************************************************************************/
+
+struct BCCompiler {
+	BCFunction &Fn;
+	unsigned Dst;
+
+	void emit(Opcode Op, unsigned A, uint32_t B = 0, uint32_t C = 0) {
+		Fn.Code.push_back({Op, uint16_t(A), B, C});
+	}
+
+	// make register R usable, false if the function would need too many
+	bool useReg(unsigned R) {
+		if (R >= MaxRegs)
+			return false;
+		Fn.NumRegs = std::max(Fn.NumRegs, R + 1);
+		return true;
+	}
+
+	// compile E with D as the first free register, -1 on failure
+	int compile(const ExprAST &E, unsigned D) {
+		unsigned Saved = Dst;
+		Dst = D;
+		int R = visit(E, *this);
+		Dst = Saved;
+		return R;
+	}
+
+	// compile E so that its value ends up in D itself
+	bool compileTo(const ExprAST &E, unsigned D) {
+		int R = compile(E, D);
+		if (R < 0 || !useReg(D))
+			return false;
+		if (unsigned(R) != D)
+			emit(op_move, D, R);
+		return true;
+	}
+
+	int operator()(const NumberExprAST &E) {
+		if (!useReg(Dst))
+			return -1;
+		emit(op_const, Dst, addConst(E.getVal()));
+		return Dst;
+	}
+
+	int operator()(const VariableExprAST &E) { return E.getSlot(); }
+
+	uint32_t addConst(double V) {
+		Fn.Consts.push_back(V);
+		return Fn.Consts.size() - 1;
+	}
+
+	// a constant RHS is read from K[C] rather than loaded into a register
+	int operator()(const BinaryExprAST &E) {
+		int L = compile(E.getLHS(), Dst);
+		if (L < 0)
+			return -1;
+		if (auto *RHS = dyn_cast<NumberExprAST>(&E.getRHS())) {
+			if (!useReg(Dst))
+				return -1;
+			uint32_t C = addConst(RHS->getVal());
+			switch (E.getOp()) {
+				case '<': emit(op_ltk, Dst, L, C); break;
+				case '+': emit(op_addk, Dst, L, C); break;
+				case '-': emit(op_subk, Dst, L, C); break;
+				case '*': emit(op_mulk, Dst, L, C); break;
+			}
+			return Dst;
+		}
+		// RHS is computed above Dst, which may still hold LHS
+		int R = compile(E.getRHS(), Dst + 1);
+		if (R < 0 || !useReg(Dst))
+			return -1;
+		switch (E.getOp()) {
+			case '<': emit(op_lt, Dst, L, R); break;
+			case '+': emit(op_add, Dst, L, R); break;
+			case '-': emit(op_sub, Dst, L, R); break;
+			case '*': emit(op_mul, Dst, L, R); break;
+		}
+		return Dst;
+	}
+
+	// the arguments go to Dst, Dst+1, ..., where the callee's window starts
+	int operator()(const CallExprAST &E) {
+		auto &Args = E.getArgs();
+		for (unsigned I = 0; I < Args.size(); ++I)
+			if (!compileTo(*Args[I], Dst + I))
+				return -1;
+		if (!useReg(Dst))
+			return -1;
+		if (E.isTail()) {
+			emit(op_tailcall, Dst, E.getCalleeIndex(), Args.size());
+			emit(op_ret, Dst);
+			return Dst;
+		}
+		emit(op_call, Dst, E.getCalleeIndex(), Args.size());
+		return Dst;
+	}
+
+	// emit the jump to the else branch, a '<' condition becomes one compare
+	// and branch instead of a compare into a register and a test of it
+	bool emitJumpUnless(const ExprAST &Cond) {
+		auto *B = dyn_cast<BinaryExprAST>(&Cond);
+		if (!B || B->getOp() != '<') {
+			int R = compile(Cond, Dst);
+			if (R < 0)
+				return false;
+			emit(op_jump_false, R);
+			return true;
+		}
+		int L = compile(B->getLHS(), Dst);
+		if (L < 0)
+			return false;
+		if (auto *RHS = dyn_cast<NumberExprAST>(&B->getRHS())) {
+			emit(op_jump_nltk, L, 0, addConst(RHS->getVal()));
+			return true;
+		}
+		int R = compile(B->getRHS(), Dst + 1);
+		if (R < 0)
+			return false;
+		emit(op_jump_nlt, L, 0, R);
+		return true;
+	}
+
+	int operator()(const IfExprAST &E) {
+		if (!emitJumpUnless(E.getCond()))
+			return -1;
+		size_t JumpToElse = Fn.Code.size() - 1;
+		if (!compileTo(E.getThen(), Dst))
+			return -1;
+		size_t JumpToEnd = Fn.Code.size();
+		emit(op_jump, 0);
+		Fn.Code[JumpToElse].B = Fn.Code.size();
+		if (!compileTo(E.getElse(), Dst))
+			return -1;
+		Fn.Code[JumpToEnd].B = Fn.Code.size();
+		return Dst;
+	}
+};
+
+// compile a resolved function, null if it needs more than MaxRegs registers.
+// such a function still runs, the VM hands calls to it to the evaluator
+static std::unique_ptr<BCFunction> CompileBytecode(const FunctionAST &Fn) {
+	auto BC = std::make_unique<BCFunction>();
+	unsigned NumParams = Fn.getProto().getArgs().size();
+	BC->NumRegs = NumParams;
+	BCCompiler C = {*BC, NumParams};
+	int R = C.compile(Fn.getBody(), NumParams);
+	if (R < 0)
+		return nullptr;
+	C.emit(op_ret, R);
+	return BC;
+}
+
+/*******************************************************************************
+* Native code
+* what the backends that compile to machine code share. compiled functions
+* are plain C ABI functions, double f(double, ...), of up to MaxJITArgs
+* parameters. a call passes the callee's FunctionEntry and the argument count
+* as two leading integer arguments and goes through the entry's JITCode slot
+* if the count matches. double arguments travel in their own registers, so
+* compiled code and externs just ignore the two, and JITCallSlow can use them
+*******************************************************************************/
+
+#if defined(CHALICE_HAVE_JIT) || defined(CHALICE_WITH_LLVM)
+
+// parameters and call arguments are passed in registers only
+static const unsigned MaxJITArgs = 8;
+// calls active in compiled code, checked against MaxCallDepth on every entry
+static unsigned JITDepth = 0;
+static const char *const StackOverflowError = "stack overflow";
+
+// where calls go that compiled code can't make directly: functions that
+// weren't compiled, undefined functions and wrong argument counts
+static double JITCallSlow(FunctionEntry *F, unsigned NumArgs, double A0,
+			  double A1, double A2, double A3, double A4, double A5,
+			  double A6, double A7) {
+	double Args[MaxJITArgs] = {A0, A1, A2, A3, A4, A5, A6, A7};
+	return CallFunction(Functions, *F, Args, NumArgs, JITDepth + 1);
+}
+
+// point the slot of F at Code, its compiled code, or if there is none at
+// its extern or JITCallSlow
+static void SetJITSlot(FunctionEntry &F, void *Code) {
+	F.JITCode = Code;
+	if (!Code && F.Native && F.NumParams <= MaxExternArgs)
+		F.JITCode = F.Native;
+	if (!F.JITCode)
+		F.JITCode = reinterpret_cast<void *>(&JITCallSlow);
+}
+
+// run compiled code of a top-level expression
+static void RunJITCode(void *Code, double *Result, const char **Err) {
+	RuntimeError = nullptr;
+	// the top-level expression itself is depth 0, its entry increments this
+	JITDepth = ~0u;
+	*Result = reinterpret_cast<double (*)()>(Code)();
+	*Err = RuntimeError;
+}
+
+#endif
+
+/*******************************************************************************
+* x86-64 JIT
+* a template JIT: every node is translated to a fixed instruction sequence
+* working on scalar doubles in SSE2 registers, with no optimizer behind it.
+* the value of an expression ends up in xmm0, parameters and temporaries live
+* in the stack frame. a call loads the callee's FunctionEntry into rdi and the
+* argument count into esi. code pages are never writable and executable at
+* the same time. the same code generator writes object files ahead of time
+*******************************************************************************/
+
+#ifdef CHALICE_HAVE_JIT
+
+// JIT code is mapped in chunks of at least this size
+static const size_t JITChunkSize = 1 << 16;
+
+// JITMemory - executable memory for JIT code. code is copied in with the
+// pages it goes to made writable for the copy only, so no page is ever both
+// writable and executable
+class JITMemory {
+	struct Chunk {
+		uint8_t *Base;
+		size_t Size;
+		size_t Used;
+	};
+	std::vector<Chunk> Chunks;
+
+public:
+	JITMemory() = default;
+	JITMemory(const JITMemory &) = delete;
+	JITMemory &operator=(const JITMemory &) = delete;
+	~JITMemory() {
+		for (auto &C : Chunks)
+			munmap(C.Base, C.Size);
+	}
+
+	// copy Code to executable memory, null if it can't be mapped
+	void *add(const std::vector<uint8_t> &Code);
+	// drop everything but the first chunk, for code that is run once
+	void reset() {
+		for (size_t I = 1; I < Chunks.size(); ++I)
+			munmap(Chunks[I].Base, Chunks[I].Size);
+		Chunks.resize(std::min<size_t>(Chunks.size(), 1));
+		if (!Chunks.empty())
+			Chunks[0].Used = 0;
+	}
+};
+
+void *JITMemory::add(const std::vector<uint8_t> &Code) {
+	size_t PageSize = sysconf(_SC_PAGESIZE);
+	if (Chunks.empty() || Chunks.back().Size - Chunks.back().Used < Code.size()) {
+		size_t Size = std::max(JITChunkSize,
+				       (Code.size() + PageSize - 1) & ~(PageSize - 1));
+		void *P = mmap(nullptr, Size, PROT_READ | PROT_EXEC,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (P == MAP_FAILED)
+			return nullptr;
+		Chunks.push_back({static_cast<uint8_t *>(P), Size, 0});
+	}
+
+	Chunk &C = Chunks.back();
+	uint8_t *Dst = C.Base + C.Used;
+	uintptr_t Lo = uintptr_t(Dst) & ~(PageSize - 1);
+	uintptr_t Hi = (uintptr_t(Dst) + Code.size() + PageSize - 1) & ~(PageSize - 1);
+	if (mprotect(reinterpret_cast<void *>(Lo), Hi - Lo, PROT_READ | PROT_WRITE))
+		return nullptr;
+	memcpy(Dst, Code.data(), Code.size());
+	mprotect(reinterpret_cast<void *>(Lo), Hi - Lo, PROT_READ | PROT_EXEC);
+	// keep every function 16 byte aligned
+	C.Used = std::min(C.Size, (C.Used + Code.size() + 15) & ~size_t(15));
+	return Dst;
+}
+
+// code of defined functions. a redefined function's old code stays, other
+// code may still hold its address until the slot has been updated
+static JITMemory JITCode;
+// code of the top-level expression being run
+static JITMemory JITScratch;
+
+// a call to be linked against Symbol, Offset is where its rel32 is
+struct NativeReloc {
+	size_t Offset;
+	std::string Symbol;
+};
+
+// X86Emitter - visitor emitting the code for an expression into Buf, the
+// value ends up in xmm0. Slot is the first free stack slot, slot S lives at
+// [rbp - 8*(S+1)]
+struct X86Emitter {
+	std::vector<uint8_t> Buf;
+	unsigned Slot = 0;
+	unsigned NumSlots = 0;
+	// rel32 fields of jumps to the error exit
+	std::vector<size_t> ErrorJumps;
+	// for code compiled ahead of time: calls go straight to the callee's
+	// symbol and are recorded here, with no checks around them. a call
+	// that can't be linked leaves its callee in BadCallee
+	std::vector<NativeReloc> *Relocs = nullptr;
+	const FunctionEntry *BadCallee = nullptr;
+	// the function being compiled and where its body starts, after the
+	// prologue and before the parameters are stored. a tail call to itself
+	// jumps back there
+	const FunctionAST *Self = nullptr;
+	size_t BodyStart = 0;
+
+	void byte(uint8_t B) { Buf.push_back(B); }
+	void bytes(std::initializer_list<uint8_t> Bs) { Buf.insert(Buf.end(), Bs); }
+	void imm32(uint32_t V) {
+		for (int I = 0; I < 4; ++I)
+			byte(V >> (8 * I));
+	}
+	void imm64(uint64_t V) {
+		for (int I = 0; I < 8; ++I)
+			byte(V >> (8 * I));
+	}
+	void ptr(const void *P) { imm64(uint64_t(uintptr_t(P))); }
+
+	// a jump with a rel32 to be patched, returns where the rel32 is
+	size_t jump(std::initializer_list<uint8_t> Opcode) {
+		bytes(Opcode);
+		imm32(0);
+		return Buf.size() - 4;
+	}
+	// point the rel32 at Fixup to Target, by default the current position
+	void patch(size_t Fixup, size_t Target) {
+		uint32_t Rel = Target - (Fixup + 4);
+		memcpy(&Buf[Fixup], &Rel, 4);
+	}
+	void patch(size_t Fixup) { patch(Fixup, Buf.size()); }
+
+	int32_t slotOffset(unsigned S) { return -8 * int32_t(S + 1); }
+	void useSlot(unsigned S) { NumSlots = std::max(NumSlots, S + 1); }
+
+	// the instruction sequences below that return a position return where
+	// the immediate that differs per use is, for patching it later
+
+	// movsd xmmX, [rbp + disp32] and back
+	size_t loadSlot(unsigned X, unsigned S) {
+		bytes({0xF2, 0x0F, 0x10, uint8_t(0x85 | X << 3)});
+		imm32(slotOffset(S));
+		return Buf.size() - 4;
+	}
+	size_t storeSlot(unsigned X, unsigned S) {
+		useSlot(S);
+		bytes({0xF2, 0x0F, 0x11, uint8_t(0x85 | X << 3)});
+		imm32(slotOffset(S));
+		return Buf.size() - 4;
+	}
+	// mov rax, imm64; movq xmmX, rax
+	size_t loadBits(unsigned X, uint64_t Bits) {
+		bytes({0x48, 0xB8});
+		imm64(Bits);
+		bytes({0x66, 0x48, 0x0F, 0x6E, uint8_t(0xC0 | X << 3)});
+		return Buf.size() - 13;
+	}
+	void zero(unsigned X) {
+		bytes({0x66, 0x0F, 0x57, uint8_t(0xC0 | X << 3 | X)}); // xorpd
+	}
+	void loadConst(unsigned X, double V) {
+		uint64_t Bits;
+		memcpy(&Bits, &V, sizeof(Bits));
+		if (Bits)
+			loadBits(X, Bits);
+		else
+			zero(X);
+	}
+	// the right operand from xmm0 into xmm1, the left one back from slot S
+	size_t reloadLHS(unsigned S) {
+		bytes({0x66, 0x0F, 0x28, 0xC8});	// movapd xmm1, xmm0
+		return loadSlot(0, S);
+	}
+	// xmm0 = xmm0 Op xmm1
+	void arith(char Op) {
+		switch (Op) {
+			case '+': bytes({0xF2, 0x0F, 0x58, 0xC1}); break; // addsd xmm0, xmm1
+			case '-': bytes({0xF2, 0x0F, 0x5C, 0xC1}); break; // subsd xmm0, xmm1
+			case '*': bytes({0xF2, 0x0F, 0x59, 0xC1}); break; // mulsd xmm0, xmm1
+			case '<':
+				// xmm1 above xmm0, false if either is NaN
+				bytes({0x66, 0x0F, 0x2E, 0xC8});	// ucomisd xmm1, xmm0
+				bytes({0x0F, 0x97, 0xC0});		// seta al
+				bytes({0x0F, 0xB6, 0xC0});		// movzx eax, al
+				bytes({0xF2, 0x0F, 0x2A, 0xC0});	// cvtsi2sd xmm0, eax
+			break;
+		}
+	}
+	// branch if xmm0 is false, equal and unordered both set ZF and
+	// IsTrue() is false for both
+	size_t jumpIfFalse() {
+		bytes({0x66, 0x0F, 0x57, 0xC9});	// xorpd xmm1, xmm1
+		bytes({0x66, 0x0F, 0x2E, 0xC1});	// ucomisd xmm0, xmm1
+		return jump({0x0F, 0x84});		// je
+	}
+	// branch unless xmm0 < xmm1, jbe also catches NaN
+	size_t jumpIfNotLess() {
+		bytes({0x66, 0x0F, 0x2E, 0xC8});	// ucomisd xmm1, xmm0
+		return jump({0x0F, 0x86});		// jbe
+	}
+
+	// call NumArgs arguments through Callee's slot if the arity matches,
+	// JITCallSlow otherwise. a call in tail position leaves this frame and
+	// its depth to the callee, which returns to our caller and checks for
+	// errors. any other call is followed by a jump to the error exit,
+	// added to ErrorJumps
+	void callSlot(const FunctionEntry &Callee, unsigned NumArgs, bool Tail) {
+		const char *Base = reinterpret_cast<const char *>(&Callee);
+		int32_t CodeOff = reinterpret_cast<const char *>(&Callee.JITCode) - Base;
+		int32_t ParamsOff = reinterpret_cast<const char *>(&Callee.NumParams) - Base;
+		bytes({0x48, 0xBF});				// mov rdi, &Callee
+		ptr(&Callee);
+		byte(0xBE);					// mov esi, NumArgs
+		imm32(NumArgs);
+		bytes({0x48, 0x8B, 0x87});			// mov rax, [rdi + CodeOff]
+		imm32(CodeOff);
+		bytes({0x3B, 0xB7});				// cmp esi, [rdi + ParamsOff]
+		imm32(ParamsOff);
+		bytes({0x74, 0x0A});				// je over the mov
+		bytes({0x48, 0xB8});				// mov rax, JITCallSlow
+		ptr(reinterpret_cast<const void *>(&JITCallSlow));
+		if (Tail) {
+			bytes({0x48, 0xB9});			// mov rcx, &JITDepth
+			ptr(&JITDepth);
+			bytes({0x83, 0x29, 0x01});		// sub dword [rcx], 1
+			bytes({0xC9, 0xFF, 0xE0});		// leave; jmp rax
+			return;
+		}
+		bytes({0xFF, 0xD0});				// call rax
+
+		// stop at run-time errors
+		bytes({0x48, 0xB8});				// mov rax, &RuntimeError
+		ptr(&RuntimeError);
+		bytes({0x48, 0x83, 0x38, 0x00});		// cmp qword [rax], 0
+		ErrorJumps.push_back(jump({0x0F, 0x85}));	// jne error
+	}
+
+	// set up the frame, returns where its size goes
+	size_t frame() {
+		bytes({0x55});					// push rbp
+		bytes({0x48, 0x89, 0xE5});			// mov rbp, rsp
+		bytes({0x48, 0x81, 0xEC});			// sub rsp, frame size
+		imm32(0);
+		return Buf.size() - 4;
+	}
+	// ++JITDepth, which the exit takes back down, and jumps to the
+	// overflow exit when it or the native stack run out
+	struct DepthChecks {
+		size_t Overflow;
+		size_t OutOfStack;
+	};
+	DepthChecks enter() {
+		DepthChecks C;
+		bytes({0x48, 0xB8});				// mov rax, &JITDepth
+		ptr(&JITDepth);
+		bytes({0x83, 0x00, 0x01});			// add dword [rax], 1
+		bytes({0x81, 0x38});				// cmp dword [rax], MaxCallDepth
+		imm32(MaxCallDepth);
+		C.Overflow = jump({0x0F, 0x87});		// ja overflow
+		bytes({0x48, 0xB9});				// mov rcx, &NativeStackLimit
+		ptr(&NativeStackLimit);
+		bytes({0x48, 0x3B, 0x21});			// cmp rsp, [rcx]
+		C.OutOfStack = jump({0x0F, 0x82});		// jb overflow
+		return C;
+	}
+	// the exits: the normal one here, with the result in xmm0, then the
+	// stack overflow and run-time error ones, which end in it
+	struct Exits {
+		size_t Overflow;
+		size_t Error;
+	};
+	Exits exit() {
+		Exits X;
+		size_t Start = Buf.size();
+		bytes({0x48, 0xB8});				// mov rax, &JITDepth
+		ptr(&JITDepth);
+		bytes({0x83, 0x28, 0x01});			// sub dword [rax], 1
+		bytes({0xC9, 0xC3});				// leave; ret
+		X.Overflow = Buf.size();
+		bytes({0x48, 0xB8});				// mov rax, &RuntimeError
+		ptr(&RuntimeError);
+		bytes({0x48, 0xB9});				// mov rcx, "stack overflow"
+		ptr(StackOverflowError);
+		bytes({0x48, 0x89, 0x08});			// mov [rax], rcx
+		X.Error = Buf.size();
+		zero(0);
+		bytes({0xEB, uint8_t(Start - (Buf.size() + 2))}); // jmp to the start
+		return X;
+	}
+
+	bool compile(const ExprAST &E, unsigned S) {
+		unsigned Saved = Slot;
+		Slot = S;
+		bool OK = visit(E, *this);
+		Slot = Saved;
+		return OK;
+	}
+
+	// numbers and variables can be loaded into any register without going
+	// through xmm0
+	static bool isLeaf(const ExprAST &E) {
+		return isa<NumberExprAST>(&E) || isa<VariableExprAST>(&E);
+	}
+	void loadLeaf(unsigned X, const ExprAST &E) {
+		if (auto *N = dyn_cast<NumberExprAST>(&E))
+			loadConst(X, N->getVal());
+		else
+			loadSlot(X, static_cast<const VariableExprAST &>(E).getSlot());
+	}
+
+	// the operands of a binary operator into xmm0 and xmm1
+	bool compileOperands(const BinaryExprAST &E) {
+		if (!compile(E.getLHS(), Slot))
+			return false;
+		if (isLeaf(E.getRHS())) {
+			loadLeaf(1, E.getRHS());
+			return true;
+		}
+		storeSlot(0, Slot);
+		if (!compile(E.getRHS(), Slot + 1))
+			return false;
+		reloadLHS(Slot);
+		return true;
+	}
+
+	bool operator()(const NumberExprAST &E) {
+		loadConst(0, E.getVal());
+		return true;
+	}
+
+	bool operator()(const VariableExprAST &E) {
+		loadSlot(0, E.getSlot());
+		return true;
+	}
+
+	bool operator()(const BinaryExprAST &E) {
+		if (!compileOperands(E))
+			return false;
+		arith(E.getOp());
+		return true;
+	}
+
+	bool operator()(const CallExprAST &E) {
+		auto &Args = E.getArgs();
+		if (Args.size() > MaxJITArgs)
+			return false;
+		for (unsigned I = 0; I < Args.size(); ++I) {
+			if (!compile(*Args[I], Slot + I))
+				return false;
+			if (Args.size() > 1)
+				storeSlot(0, Slot + I);
+		}
+		for (unsigned I = 0; Args.size() > 1 && I < Args.size(); ++I)
+			loadSlot(I, Slot + I);
+
+		FunctionEntry &Callee = Functions.get(E.getCalleeIndex());
+		if (E.isTail() && Self && Callee.AST.get() == Self &&
+		    Args.size() == Self->getProto().getArgs().size()) {
+			patch(jump({0xE9}), BodyStart);		// jmp to the body
+			return true;
+		}
+
+		if (Relocs) {
+			if (!(Callee.Defined || Callee.Extern) ||
+			    Callee.NumParams != Args.size()) {
+				BadCallee = &Callee;
+				return false;
+			}
+			if (E.isTail())
+				byte(0xC9);			// leave
+			byte(E.isTail() ? 0xE9 : 0xE8);		// jmp or call rel32
+			Relocs->push_back({Buf.size(), Callee.Name});
+			imm32(0);
+			return true;
+		}
+
+		// a callee that isn't defined yet starts out with JITCallSlow
+		if (!Callee.JITCode)
+			Callee.JITCode = reinterpret_cast<void *>(&JITCallSlow);
+		callSlot(Callee, Args.size(), E.isTail());
+		return true;
+	}
+
+	bool operator()(const IfExprAST &E) {
+		size_t JumpToElse;
+		auto *B = dyn_cast<BinaryExprAST>(&E.getCond());
+		if (B && B->getOp() == '<') {
+			// compare and branch
+			unsigned Saved = Slot;
+			bool OK = compileOperands(*B);
+			Slot = Saved;
+			if (!OK)
+				return false;
+			JumpToElse = jumpIfNotLess();
+		} else {
+			if (!compile(E.getCond(), Slot))
+				return false;
+			JumpToElse = jumpIfFalse();
+		}
+		if (!compile(E.getThen(), Slot))
+			return false;
+		size_t JumpToEnd = jump({0xE9});		// jmp end
+		patch(JumpToElse);
+		if (!compile(E.getElse(), Slot))
+			return false;
+		patch(JumpToEnd);
+		return true;
+	}
+};
+
+// emit a resolved function at the end of E.Buf, false if it takes or passes
+// more than MaxJITArgs arguments. JIT code keeps JITDepth and stops at
+// run-time errors, code compiled ahead of time is a plain C function
+static bool EmitNativeFunction(const FunctionAST &Fn, X86Emitter &E) {
+	unsigned NumParams = Fn.getProto().getArgs().size();
+	if (NumParams > MaxJITArgs)
+		return false;
+
+	size_t FrameSize = E.frame();
+	E.Self = &Fn;
+	if (E.Relocs) {
+		E.BodyStart = E.Buf.size();
+		for (unsigned I = 0; I < NumParams; ++I)
+			E.storeSlot(I, I);
+		if (!E.compile(Fn.getBody(), NumParams))
+			return false;
+		E.bytes({0xC9, 0xC3});			// leave; ret
+		uint32_t Frame = (E.NumSlots * 8 + 15) & ~15u;
+		memcpy(&E.Buf[FrameSize], &Frame, 4);
+		return true;
+	}
+
+	auto Checks = E.enter();
+	E.BodyStart = E.Buf.size();
+	for (unsigned I = 0; I < NumParams; ++I)
+		E.storeSlot(I, I);
+	if (!E.compile(Fn.getBody(), NumParams))
+		return false;
+	auto X = E.exit();
+	E.patch(Checks.Overflow, X.Overflow);
+	E.patch(Checks.OutOfStack, X.Overflow);
+	for (size_t Fixup : E.ErrorJumps)
+		E.patch(Fixup, X.Error);
+
+	// keep rsp 16 byte aligned at calls
+	uint32_t Frame = (E.NumSlots * 8 + 15) & ~15u;
+	memcpy(&E.Buf[FrameSize], &Frame, 4);
+	return true;
+}
+
+// compile a resolved function to native code, null if EmitNativeFunction
+// can't or the code can't be mapped
+static void *CompileNative(const FunctionAST &Fn, JITMemory &Mem) {
+	X86Emitter E;
+	if (!EmitNativeFunction(Fn, E))
+		return nullptr;
+	return Mem.add(E.Buf);
+}
+
+// run a top-level expression as native code, false if it can't be compiled
+static bool RunNative(const FunctionAST &Fn, double *Result, const char **Err) {
+	JITScratch.reset();
+	void *Code = CompileNative(Fn, JITScratch);
+	if (!Code)
+		return false;
+	RunJITCode(Code, Result, Err);
+	return true;
+}
+
+#endif // CHALICE_HAVE_JIT
+
+/*******************************************************************************
+* LLVM backend
+* lowers resolved functions to LLVM IR, runs the standard -O2 pipeline over
+* them and JIT compiles them with ORC. the code follows the same conventions
+* as the x86-64 JIT, so both can call each other's functions through the
+* function table. every function is a module of its own, so redefining one
+* just adds a new module under a new symbol name. externs are called through
+* the table as well, so a later def of the same name takes their place
+*******************************************************************************/
+
+#ifdef CHALICE_WITH_LLVM
+
+static std::unique_ptr<llvm::orc::LLJIT> LLVMJIT;
+static std::unique_ptr<llvm::TargetMachine> LLVMTarget;
+// numbers the symbols of compiled functions, which are never reused
+static unsigned LLVMSymbols = 0;
+
+// start ORC on first use, false after printing why it can't be started
+static bool InitLLVM() {
+	if (LLVMJIT)
+		return true;
+	llvm::InitializeNativeTarget();
+	llvm::InitializeNativeTargetAsmPrinter();
+
+	auto JIT = llvm::orc::LLJITBuilder().create();
+	if (!JIT) {
+		fprintf(stderr, "error: LLVM: %s\n",
+			llvm::toString(JIT.takeError()).c_str());
+		return false;
+	}
+	auto Gen = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+		(*JIT)->getDataLayout().getGlobalPrefix());
+	if (!Gen) {
+		fprintf(stderr, "error: LLVM: %s\n",
+			llvm::toString(Gen.takeError()).c_str());
+		return false;
+	}
+	(*JIT)->getMainJITDylib().addGenerator(std::move(*Gen));
+	LLVMJIT = std::move(*JIT);
+
+	// only used to tune the optimizer for the host, it runs without
+	if (auto JTMB = llvm::orc::JITTargetMachineBuilder::detectHost()) {
+		if (auto TM = JTMB->createTargetMachine())
+			LLVMTarget = std::move(*TM);
+		else
+			llvm::consumeError(TM.takeError());
+	} else
+		llvm::consumeError(JTMB.takeError());
+	return true;
+}
+
+// IRGen - visitor emitting the IR for an expression at the builder's
+// position. returns null for calls with more than MaxJITArgs arguments
+struct IRGen {
+	llvm::IRBuilder<> &B;
+	llvm::Module &M;
+	llvm::Function *Self;
+	const FunctionEntry *SelfEntry;	// null for top-level expressions
+	std::vector<llvm::PHINode *> Params;	// in Body
+	llvm::BasicBlock *Body;		// a tail call to Self branches here
+	llvm::BasicBlock *Error;	// returns 0 after a run-time error
+	llvm::MDNode *Unlikely;
+
+	// a host object as a constant pointer to Ty
+	llvm::Value *hostPtr(const void *P, llvm::Type *Ty) {
+		return B.CreateIntToPtr(B.getInt64(uintptr_t(P)), Ty->getPointerTo());
+	}
+
+	void checkError() {
+		llvm::Type *I8P = B.getInt8PtrTy();
+		llvm::Value *Err = B.CreateLoad(I8P, hostPtr(&RuntimeError, I8P));
+		auto *Cont = llvm::BasicBlock::Create(M.getContext(), "cont", Self);
+		B.CreateCondBr(B.CreateIsNotNull(Err), Error, Cont, Unlikely);
+		B.SetInsertPoint(Cont);
+	}
+
+	// code after a branch or return in tail position is never reached
+	llvm::Value *unreachable() {
+		B.SetInsertPoint(llvm::BasicBlock::Create(M.getContext(), "dead", Self));
+		return llvm::UndefValue::get(B.getDoubleTy());
+	}
+
+	llvm::Value *operator()(const NumberExprAST &E) {
+		return llvm::ConstantFP::get(B.getDoubleTy(), E.getVal());
+	}
+
+	llvm::Value *operator()(const VariableExprAST &E) { return Params[E.getSlot()]; }
+
+	llvm::Value *operator()(const BinaryExprAST &E) {
+		llvm::Value *L = visit(E.getLHS(), *this);
+		if (!L)
+			return nullptr;
+		llvm::Value *R = visit(E.getRHS(), *this);
+		if (!R)
+			return nullptr;
+		switch (E.getOp()) {
+			case '+': return B.CreateFAdd(L, R);
+			case '-': return B.CreateFSub(L, R);
+			case '*': return B.CreateFMul(L, R);
+		}
+		// ordered, so NaN compares false
+		return B.CreateUIToFP(B.CreateFCmpOLT(L, R), B.getDoubleTy());
+	}
+
+	llvm::Value *operator()(const CallExprAST &E) {
+		std::vector<llvm::Value *> Args;
+		for (auto &Arg : E.getArgs()) {
+			Args.push_back(visit(*Arg, *this));
+			if (!Args.back())
+				return nullptr;
+		}
+		unsigned N = Args.size();
+		if (N > MaxJITArgs)
+			return nullptr;
+		const FunctionEntry &Callee = Functions.get(E.getCalleeIndex());
+
+		// recursion in tail position loops, other recursion calls the
+		// function itself, which LLVM can see through
+		if (&Callee == SelfEntry && N == Self->arg_size() && E.isTail()) {
+			for (unsigned I = 0; I < N; ++I)
+				Params[I]->addIncoming(Args[I], B.GetInsertBlock());
+			B.CreateBr(Body);
+			return unreachable();
+		}
+		if (&Callee == SelfEntry && N == Self->arg_size()) {
+			llvm::Value *Call = B.CreateCall(Self, Args);
+			checkError();
+			return Call;
+		}
+
+		// everything else through the callee's slot, externs too: a later
+		// def of the same name replaces the host function
+		llvm::Type *I8P = B.getInt8PtrTy();
+		std::vector<llvm::Type *> Types = {I8P, B.getInt32Ty()};
+		Types.insert(Types.end(), N, B.getDoubleTy());
+		auto *FT = llvm::FunctionType::get(B.getDoubleTy(), Types, false);
+		llvm::Value *Slot = B.CreateLoad(I8P, hostPtr(&Callee.JITCode, I8P));
+		llvm::Value *NumParams = B.CreateLoad(
+			B.getInt32Ty(), hostPtr(&Callee.NumParams, B.getInt32Ty()));
+		llvm::Value *Slow = B.CreateIntToPtr(
+			B.getInt64(uintptr_t(&JITCallSlow)), I8P);
+		llvm::Value *Target = B.CreateSelect(
+			B.CreateICmpEQ(NumParams, B.getInt32(N)), Slot, Slow);
+		Args.insert(Args.begin(), {B.CreateIntToPtr(B.getInt64(uintptr_t(&Callee)), I8P),
+					   B.getInt32(N)});
+		if (E.isTail()) {
+			// leave the depth to the callee and return what it does,
+			// the caller checks for errors
+			llvm::Value *DepthPtr = hostPtr(&JITDepth, B.getInt32Ty());
+			B.CreateStore(B.CreateSub(B.CreateLoad(B.getInt32Ty(), DepthPtr),
+						  B.getInt32(1)), DepthPtr);
+			llvm::CallInst *Call = B.CreateCall(
+				FT, B.CreateBitCast(Target, FT->getPointerTo()), Args);
+			Call->setTailCall();
+			B.CreateRet(Call);
+			return unreachable();
+		}
+		llvm::Value *Call = B.CreateCall(
+			FT, B.CreateBitCast(Target, FT->getPointerTo()), Args);
+		checkError();
+		return Call;
+	}
+
+	llvm::Value *operator()(const IfExprAST &E) {
+		llvm::Value *Cond = visit(E.getCond(), *this);
+		if (!Cond)
+			return nullptr;
+		Cond = B.CreateFCmpONE(Cond, llvm::ConstantFP::get(B.getDoubleTy(), 0.0));
+
+		auto &Ctx = M.getContext();
+		auto *ThenBB = llvm::BasicBlock::Create(Ctx, "then", Self);
+		auto *ElseBB = llvm::BasicBlock::Create(Ctx, "else", Self);
+		auto *MergeBB = llvm::BasicBlock::Create(Ctx, "ifcont", Self);
+		B.CreateCondBr(Cond, ThenBB, ElseBB);
+
+		B.SetInsertPoint(ThenBB);
+		llvm::Value *Then = visit(E.getThen(), *this);
+		if (!Then)
+			return nullptr;
+		ThenBB = B.GetInsertBlock();
+		B.CreateBr(MergeBB);
+
+		B.SetInsertPoint(ElseBB);
+		llvm::Value *Else = visit(E.getElse(), *this);
+		if (!Else)
+			return nullptr;
+		ElseBB = B.GetInsertBlock();
+		B.CreateBr(MergeBB);
+
+		B.SetInsertPoint(MergeBB);
+		llvm::PHINode *PN = B.CreatePHI(B.getDoubleTy(), 2);
+		PN->addIncoming(Then, ThenBB);
+		PN->addIncoming(Else, ElseBB);
+		return PN;
+	}
+};
+
+static void OptimizeModule(llvm::Module &M) {
+	llvm::LoopAnalysisManager LAM;
+	llvm::FunctionAnalysisManager FAM;
+	llvm::CGSCCAnalysisManager CGAM;
+	llvm::ModuleAnalysisManager MAM;
+	llvm::PassBuilder PB(LLVMTarget.get());
+	PB.registerModuleAnalyses(MAM);
+	PB.registerCGSCCAnalyses(CGAM);
+	PB.registerFunctionAnalyses(FAM);
+	PB.registerLoopAnalyses(LAM);
+	PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+	PB.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2).run(M, MAM);
+}
+
+// compile a resolved function, Entry is its table entry or null for a
+// top-level expression. the module goes under RT if one is given. null if
+// the function can't be compiled
+static void *CompileLLVM(const FunctionAST &Fn, const FunctionEntry *Entry,
+			 llvm::orc::ResourceTrackerSP RT = nullptr) {
+	unsigned NumParams = Fn.getProto().getArgs().size();
+	if (NumParams > MaxJITArgs || !InitLLVM())
+		return nullptr;
+
+	auto Ctx = std::make_unique<llvm::LLVMContext>();
+	auto M = std::make_unique<llvm::Module>("chalice", *Ctx);
+	M->setDataLayout(LLVMJIT->getDataLayout());
+	llvm::IRBuilder<> B(*Ctx);
+
+	std::string Name = (Entry ? Entry->Name : std::string("__expr")) + "." +
+			   std::to_string(++LLVMSymbols);
+	std::vector<llvm::Type *> Types(NumParams, B.getDoubleTy());
+	auto *FT = llvm::FunctionType::get(B.getDoubleTy(), Types, false);
+	auto *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name,
+					 M.get());
+
+	auto *EntryBB = llvm::BasicBlock::Create(*Ctx, "entry", F);
+	auto *BodyBB = llvm::BasicBlock::Create(*Ctx, "body", F);
+	auto *OverflowBB = llvm::BasicBlock::Create(*Ctx, "overflow", F);
+	auto *ErrorBB = llvm::BasicBlock::Create(*Ctx, "error", F);
+	auto *ExitBB = llvm::BasicBlock::Create(*Ctx, "exit", F);
+	auto *Result = llvm::PHINode::Create(B.getDoubleTy(), 2, "result", ExitBB);
+
+	IRGen Gen = {B, *M, F, Entry, {}, BodyBB, ErrorBB,
+		     llvm::MDBuilder(*Ctx).createBranchWeights(1, 2000)};
+	B.SetInsertPoint(BodyBB);
+	for (auto &Arg : F->args()) {
+		Gen.Params.push_back(B.CreatePHI(B.getDoubleTy(), 2));
+		Gen.Params.back()->addIncoming(&Arg, EntryBB);
+	}
+
+	// ++JITDepth, which the exit takes back down
+	B.SetInsertPoint(EntryBB);
+	llvm::Value *DepthPtr = Gen.hostPtr(&JITDepth, B.getInt32Ty());
+	llvm::Value *Depth = B.CreateAdd(B.CreateLoad(B.getInt32Ty(), DepthPtr),
+					 B.getInt32(1));
+	B.CreateStore(Depth, DepthPtr);
+	llvm::Value *Frame = B.CreatePtrToInt(
+		B.CreateIntrinsic(llvm::Intrinsic::frameaddress, {B.getInt8PtrTy()},
+				  {B.getInt32(0)}),
+		B.getInt64Ty());
+	llvm::Value *Limit = B.CreateLoad(
+		B.getInt64Ty(), Gen.hostPtr(&NativeStackLimit, B.getInt64Ty()));
+	B.CreateCondBr(B.CreateOr(B.CreateICmpUGT(Depth, B.getInt32(MaxCallDepth)),
+				  B.CreateICmpULT(Frame, Limit)),
+		       OverflowBB, BodyBB, Gen.Unlikely);
+
+	B.SetInsertPoint(BodyBB);
+	llvm::Value *Value = visit(Fn.getBody(), Gen);
+	if (!Value)
+		return nullptr;
+	Result->addIncoming(Value, B.GetInsertBlock());
+	B.CreateBr(ExitBB);
+
+	B.SetInsertPoint(OverflowBB);
+	llvm::Type *I8P = B.getInt8PtrTy();
+	B.CreateStore(B.CreateIntToPtr(B.getInt64(uintptr_t(StackOverflowError)), I8P),
+		      Gen.hostPtr(&RuntimeError, I8P));
+	B.CreateBr(ErrorBB);
+
+	B.SetInsertPoint(ErrorBB);
+	Result->addIncoming(llvm::ConstantFP::get(B.getDoubleTy(), 0.0), ErrorBB);
+	B.CreateBr(ExitBB);
+
+	B.SetInsertPoint(ExitBB);
+	B.CreateStore(B.CreateSub(B.CreateLoad(B.getInt32Ty(), DepthPtr), B.getInt32(1)),
+		      DepthPtr);
+	B.CreateRet(Result);
+
+	if (llvm::verifyFunction(*F))
+		return nullptr;
+	OptimizeModule(*M);
+
+	llvm::orc::ThreadSafeModule TSM(std::move(M), std::move(Ctx));
+	llvm::Error Err = RT ? LLVMJIT->addIRModule(RT, std::move(TSM))
+			     : LLVMJIT->addIRModule(std::move(TSM));
+	if (Err) {
+		fprintf(stderr, "error: LLVM: %s\n", llvm::toString(std::move(Err)).c_str());
+		return nullptr;
+	}
+	auto Sym = LLVMJIT->lookup(Name);
+	if (!Sym) {
+		fprintf(stderr, "error: LLVM: %s\n",
+			llvm::toString(Sym.takeError()).c_str());
+		return nullptr;
+	}
+	return reinterpret_cast<void *>(Sym->getAddress());
+}
+
+// run a top-level expression compiled by LLVM, false if it can't be
+// compiled. its code is freed again afterwards
+static bool RunLLVM(const FunctionAST &Fn, double *Result, const char **Err) {
+	if (!InitLLVM())
+		return false;
+	auto RT = LLVMJIT->getMainJITDylib().createResourceTracker();
+	void *Code = CompileLLVM(Fn, nullptr, RT);
+	if (Code)
+		RunJITCode(Code, Result, Err);
+	llvm::consumeError(RT->remove());
+	return Code;
+}
+
+#endif // CHALICE_WITH_LLVM
+
+/*******************************************************************************
+* Execution backends
+* the sequential driver hands every resolved definition and top-level
+* expression to the backend chosen with --backend
+*******************************************************************************/
+
+enum Backend {
+	backend_eval,	// walk the AST
+	backend_vm,	// compile to bytecode
+	backend_jit,	// compile to x86-64 code, the VM on other hosts
+	backend_tiered,	// interpret, then compile what gets hot like jit
+	backend_llvm,	// compile with LLVM, if built in
+};
+static Backend ExecBackend = backend_eval;
+
+// get a function that was just defined or declared extern ready to run
+static void PrepareFunction(FunctionEntry &F) {
+	if (F.AST) {
+		InlineFunction(Functions, F);
+		SetUpMemo(Functions, F);
+	}
+	if (F.Memo) {
+		// it runs in the evaluator, whose calls go through the table.
+		// compiled callers reach it through JITCallSlow or CallFunction
+#ifdef CHALICE_HAVE_JIT
+		SetJITSlot(F, nullptr);
+#endif
+		return;
+	}
+	switch (ExecBackend) {
+		case backend_eval:
+		break;
+		case backend_llvm:
+#ifdef CHALICE_WITH_LLVM
+			SetJITSlot(F, F.AST ? CompileLLVM(*F.AST, &F) : nullptr);
+		break;
+#endif
+		// fall through
+		case backend_jit:
+#ifdef CHALICE_HAVE_JIT
+			SetJITSlot(F, F.AST ? CompileNative(*F.AST, JITCode) : nullptr);
+		break;
+#endif
+		// fall through
+		case backend_tiered:
+#ifdef CHALICE_HAVE_JIT
+			// compiled by TierUp once it is hot
+			SetJITSlot(F, nullptr);
+		break;
+#endif
+		// fall through
+		case backend_vm:
+			if (F.AST)
+				F.BC = CompileBytecode(*F.AST);
+		break;
+	}
+}
+
+// F has just been redefined or prepared again. the functions that were found
+// pure because it was and no longer are lose their memo tables and are
+// prepared again, and so on for the functions that called them
+static void RecheckPureCallers(FunctionEntry &F) {
+	if (F.Pure)
+		return;
+	std::vector<uint32_t> Callers = std::move(F.PureCallers);
+	F.PureCallers.clear();
+	for (uint32_t I : Callers) {
+		FunctionEntry &Caller = Functions.get(I);
+		if (!Caller.Pure)
+			continue;
+		PurityCheck Check(Functions, Caller);
+		if (visit(Caller.AST->getBody(), Check))
+			continue;
+		PrepareFunction(Functions.define(
+			std::move(Caller.Source ? Caller.Source : Caller.AST)));
+		RecheckPureCallers(Caller);
+	}
+}
+
+// F has just been redefined. the functions that inlined its old body go back
+// to the body they were written with and are prepared again, and so on for
+// the functions that inlined them
+static void ReinlineCallers(FunctionEntry &F) {
+	uint32_t Index = Functions.getIndex(F.Name);
+	std::vector<uint32_t> Callers = std::move(F.InlinedInto);
+	F.InlinedInto.clear();
+	for (uint32_t I : Callers) {
+		FunctionEntry &Caller = Functions.get(I);
+		// it may have been redefined since, without F
+		if (!Caller.Source || std::find(Caller.Inlined.begin(), Caller.Inlined.end(),
+						Index) == Caller.Inlined.end())
+			continue;
+		PrepareFunction(Functions.define(std::move(Caller.Source)));
+		ReinlineCallers(Caller);
+		RecheckPureCallers(Caller);
+	}
+}
+
+#ifdef CHALICE_HAVE_JIT
+// compile a function that has got hot and point its slot at the code, so
+// JIT callers go straight to it too. false if it can't be compiled. kept out
+// of the evaluator's loop, which would inline the whole JIT otherwise
+__attribute__((noinline)) static bool TierUp(FunctionEntry &F) {
+	F.Tiered = CompileNative(*F.AST, JITCode);
+	if (F.Tiered)
+		SetJITSlot(F, F.Tiered);
+	return F.Tiered;
+}
+
+// call the compiled code of F from the evaluator at call depth Depth
+__attribute__((noinline)) static double CallTiered(const FunctionEntry &F,
+						   const double *Args, unsigned Depth) {
+	typedef double D;
+	double A[MaxJITArgs] = {};
+	std::copy(Args, Args + F.NumParams, A);
+	// its entry takes JITDepth to Depth and its exit back
+	unsigned SavedDepth = JITDepth;
+	JITDepth = Depth - 1;
+	D Result = reinterpret_cast<D (*)(D, D, D, D, D, D, D, D)>(F.Tiered)(
+		A[0], A[1], A[2], A[3], A[4], A[5], A[6], A[7]);
+	JITDepth = SavedDepth;
+	return Result;
+}
+#endif
+
+// run a top-level expression, anything the backend can't compile is
+// evaluated from the AST
+static bool RunTopLevel(const FunctionTable &Fns, const FunctionAST &Fn,
+			double *Result, const char **Err) {
+	switch (ExecBackend) {
+		case backend_eval:
+		break;
+		case backend_llvm:
+#ifdef CHALICE_WITH_LLVM
+			if (RunLLVM(Fn, Result, Err))
+				return !*Err;
+		break;
+#endif
+		// fall through
+		case backend_jit:
+#ifdef CHALICE_HAVE_JIT
+			if (RunNative(Fn, Result, Err))
+				return !*Err;
+		break;
+#endif
+		// fall through
+		case backend_tiered:
+#ifdef CHALICE_HAVE_JIT
+			// run once, so never worth compiling
+		break;
+#endif
+		// fall through
+		case backend_vm:
+			if (auto BC = CompileBytecode(Fn))
+				return RunBytecode(Fns, *BC, Result, Err);
+		break;
+	}
+	return Evaluate(Fns, Fn, Result, Err);
+}
+
+/*******************************************************************************
+* Top-level parsing
+*******************************************************************************/
+
+// report how much of each body could be shared as a DAG, set by --sharing-stats
+static bool ShowSharing = false;
+// print each parsed function, set by --dump-ast
+static bool DumpAST = false;
+// per item and total AST statistics, set by --ast-stats
+static bool ShowASTStats = false;
+static ASTStats TotalASTStats;
+
+// print the statistics of one item and add them to the total. Allocs is the
+// number of heap allocations parsing it took
+static void ReportASTStats(const FunctionAST *Fn, const PrototypeAST *Proto,
+			   size_t Allocs) {
+	ASTStats Stats;
+	if (Fn)
+		CollectASTStats(*Fn, Stats);
+	else
+		CollectASTStats(*Proto, Stats);
+	fprintf(stderr, "  %zu nodes, %zu bytes, depth %u, %zu allocations\n",
+		Stats.totalNodes(), Stats.totalBytes(), Stats.MaxDepth, Allocs);
+
+	for (int K = 0; K < ASTStats::sk_count; ++K) {
+		TotalASTStats.Nodes[K] += Stats.Nodes[K];
+		TotalASTStats.Bytes[K] += Stats.Bytes[K];
+	}
+	TotalASTStats.MaxDepth = std::max(TotalASTStats.MaxDepth, Stats.MaxDepth);
+	TotalASTStats.NumCallArgs += Stats.NumCallArgs;
+	TotalASTStats.NameBytes += Stats.NameBytes;
+	TotalASTStats.Allocs += Allocs;
+	++TotalASTStats.NumItems;
+}
+
+// only calls of functions known to be pure, whatever they call in turn, are
+// the same value wherever they occur
+static bool IsPureCallee(const std::string &Name) {
+	const FunctionEntry *F = Functions.find(Name);
+	return F && F->Pure;
+}
+
+static void ReportSharing(const FunctionAST &Fn) {
+	ExprDAG DAG(IsPureCallee);
+	DAG.add(Fn.getBody());
+	fprintf(stderr, "  %u expression nodes, %zu after sharing\n",
+		DAG.getNumTreeNodes(), DAG.size());
+}
+
+// what happens to an item once it is parsed. items that come from somewhere
+// else than the parser, e.g. an AST image, go through these too
+
+static void DefineFunction(std::unique_ptr<FunctionAST> Fn) {
+	if (!ResolveFunction(Functions, *Fn))
+		return;
+	FunctionEntry &F = Functions.define(std::move(Fn));
+	PrepareFunction(F);
+	ReinlineCallers(F);
+	RecheckPureCallers(F);
+	// once purity is known, on the body as written
+	if (ShowSharing)
+		ReportSharing(F.Source ? *F.Source : *F.AST);
+}
+
+static void DeclareExtern(const PrototypeAST &Proto) {
+	if (FunctionEntry *F = Functions.declareExtern(Proto))
+		PrepareFunction(*F);
+}
+
+// false if Fn doesn't resolve
+static bool RunExpression(FunctionAST &Fn) {
+	if (!ResolveFunction(Functions, Fn))
+		return false;
+	double Result;
+	const char *Err;
+	if (RunTopLevel(Functions, Fn, &Result, &Err))
+		fprintf(stderr, "Evaluated to %f\n", Result);
+	else
+		fprintf(stderr, "error: %s\n", Err);
+	return true;
+}
+
+// an item that has been parsed, Allocs is the number of heap allocations
+// parsing it took. items parsed ahead, e.g. by --parallel, are handed to these
+// in source order
+
+static void HandleParsedDefinition(std::unique_ptr<FunctionAST> Fn,
+				   size_t Allocs) {
+	fprintf(stderr, "Parsed a function definition.\n");
+	if (ShowASTStats)
+		ReportASTStats(Fn.get(), nullptr, Allocs);
+	if (DumpAST)
+		DumpFunction(*Fn, stderr);
+	DefineFunction(std::move(Fn));
+}
+
+static void HandleParsedExtern(const PrototypeAST &Proto, size_t Allocs) {
+	fprintf(stderr, "Parsed an extern.\n");
+	if (ShowASTStats)
+		ReportASTStats(nullptr, &Proto, Allocs);
+	DeclareExtern(Proto);
+}
+
+static void HandleParsedExpression(FunctionAST &Fn, size_t Allocs) {
+	if (!RunExpression(Fn))
+		return;
+	if (ShowASTStats)
+		ReportASTStats(&Fn, nullptr, Allocs);
+	if (DumpAST)
+		DumpFunction(Fn, stderr);
+	if (ShowSharing)
+		ReportSharing(Fn);
+}
+
+static void HandleDefinition() {
+	size_t Allocs = ThreadAllocs.Count;
+	if (auto Fn = ParseDefinition()) {
+		// cut short by the memory limit, MainLoop drops it
+		if (OverMemoryLimit)
+			return;
+		HandleParsedDefinition(std::move(Fn), ThreadAllocs.Count - Allocs);
+	} else {
+		// resynchronize at the next item for error recovery
+		SkipToNextItem();
+	}
+}
+static void HandleExtern() {
+	size_t Allocs = ThreadAllocs.Count;
+	if (auto Proto = ParseExtern()) {
+		if (OverMemoryLimit)
+			return;
+		Allocs = ThreadAllocs.Count - Allocs;
+		if (Proto->getArgs().size() > MaxExternArgs) {
+			LogError(diag_too_many_extern_args);
+			return SkipToNextItem();
+		}
+		HandleParsedExtern(*Proto, Allocs);
+	} else {
+		// resynchronize at the next item for error recovery
+		SkipToNextItem();
+	}
+}
+static void HandleTopLevelExpression() {
+	size_t Allocs = ThreadAllocs.Count;
+	if (auto Fn = ParseTopLevelExpr()) {
+		if (OverMemoryLimit)
+			return;
+		HandleParsedExpression(*Fn, ThreadAllocs.Count - Allocs);
+	} else {
+		// resynchronize at the next item for error recovery
+		SkipToNextItem();
+	}
+}
+
+// print "> " before each item, off in batch mode
+static bool Interactive = true;
+
+static void Prompt() {
+	if (Interactive)
+		fprintf(stderr, "> ");
+}
+
+// print the errors of the last item. returns true once there are too many to
+// go on, which only ends batch input. every entry of an interactive session
+// gets the whole limit
+static bool FlushErrors() {
+	Diags.flush(stderr);
+	if (!Interactive)
+		return Diags.tooManyErrors();
+	Diags.reset();
+	return false;
+}
+
+/*******************************************************************************
+* Streaming
+* MainLoop already drops each item once it is handled, only definitions stay
+* in the function table. --stream adds a heap ceiling, measured around every
+* item, and reports the peak at the end, so a never ending input runs in flat
+* memory as long as it doesn't keep defining new functions
+*******************************************************************************/
+
+static bool Streaming = false;
+
+struct StreamStats {
+	size_t NumItems = 0;
+	size_t NumDropped = 0;		// items over the memory limit
+	ptrdiff_t PeakBytes = 0;	// heap high-water mark
+	ptrdiff_t ItemPeakBytes = 0;	// most heap a single item added
+};
+static StreamStats Stream;
+static ptrdiff_t ItemStartBytes;
+// first token of the item, top-level semicolons aren't counted as items
+static int ItemStartTok = ';';
+
+static void BeginStreamItem() {
+	ItemStartTok = CurTok;
+	ItemStartBytes = ThreadAllocs.Live;
+	ThreadAllocs.Peak = ThreadAllocs.Live;
+}
+
+// account for the item that was just handled and freed. returns false if
+// the heap stays over the limit even without it, then there is no point in
+// reading on
+static bool EndStreamItem() {
+	if (ItemStartTok != ';')
+		++Stream.NumItems;
+	Stream.PeakBytes = std::max(Stream.PeakBytes, ThreadAllocs.Peak);
+	Stream.ItemPeakBytes = std::max(Stream.ItemPeakBytes,
+					ThreadAllocs.Peak - ItemStartBytes);
+	if (!OverMemoryLimit)
+		return true;
+
+	OverMemoryLimit = false;
+	++Stream.NumDropped;
+	LogError(diag_memory_limit);
+	if (ThreadAllocs.Live > MemoryLimit)
+		return false;
+	// CurTok is the made up end of input, the tokens the parser didn't get
+	// to are still in the input
+	getNextToken();
+	SkipToNextItem();
+	return true;
+}
+
+static void PrintStreamStats(FILE *Out) {
+	fprintf(Out, "stream: %zu items, %zu dropped, heap peak %td bytes, "
+		"largest item %td bytes\n", Stream.NumItems, Stream.NumDropped,
+		Stream.PeakBytes, Stream.ItemPeakBytes);
+}
+
+// top = def | extern | expression | ';'
+static void MainLoop() {
+	while (true) {
+		if (Streaming && !EndStreamItem()) {
+			Diags.flush(stderr);
+			fprintf(stderr, "error: memory limit exceeded, stopping now\n");
+			return;
+		}
+		if (FlushErrors())
+			return;
+		if (Streaming)
+			BeginStreamItem();
+		Prompt();
+		switch (CurTok) {
+			case tok_eof:
+			return;
+			case ';': //ignore top-level semicolons
+				getNextToken();
+			break;
+			case tok_def:
+				HandleDefinition();
+			break;
+			case tok_extern:
+				HandleExtern();
+			break;
+			default:
+				HandleTopLevelExpression();
+			break;
+		}
+	}
+}
+
+/*******************************************************************************
+* Parallel parsing
+* top-level items cannot nest, so an item always starts at 'def', 'extern' or
+* right after a ';'. no token spans lines, so the input is first cut at lines
+* starting with 'def' or 'extern' into chunks which worker threads lex. the
+* token buffer is then cut at item boundaries into chunks which they parse,
+* each with a node pool of its own
+*******************************************************************************/
+
+// pools of the parser threads after the first, which uses the main thread's
+static std::vector<std::unique_ptr<NodePool>> WorkerNodePools;
+
+// run Work(I) for I in [0, N) on NumThreads threads, the caller's included.
+// thread T > 0 allocates nodes from the T'th pool
+template <typename Fn>
+static void RunOnWorkers(size_t N, unsigned NumThreads, Fn Work) {
+	while (WorkerNodePools.size() + 1 < NumThreads)
+		WorkerNodePools.push_back(std::make_unique<NodePool>());
+	std::atomic<size_t> Next(0);
+	auto Worker = [&]() {
+		size_t I;
+		while ((I = Next++) < N)
+			Work(I);
+	};
+	std::vector<std::thread> Pool;
+	for (unsigned T = 1; T < NumThreads; ++T)
+		Pool.emplace_back([&, T]() {
+			ThreadNodePool = WorkerNodePools[T - 1].get();
+			Worker();
+		});
+	Worker();
+	for (auto &T : Pool)
+		T.join();
+}
+
+// true if Text has the keyword 'def' or 'extern' at At
+static bool StartsWithItemKeyword(const std::string &Text, size_t At) {
+	for (const char *Word : {"def", "extern"}) {
+		size_t Len = strlen(Word);
+		if (!Text.compare(At, Len, Word) &&
+		    (At + Len == Text.size() || !isalnum(Text[At + Len])))
+			return true;
+	}
+	return false;
+}
+
+// lex all of F on NumThreads workers, the same tokens as LexAll
+static std::vector<TokenRec> LexParallel(FILE *F, unsigned NumThreads) {
+	std::string Text;
+	char Buf[1 << 16];
+	while (size_t N = fread(Buf, 1, sizeof(Buf), F))
+		Text.append(Buf, N);
+
+	// cut into a few chunks per thread. the lexer counts '\r' as a line
+	// break as well
+	struct Cut {
+		size_t Offset;
+		int Line;
+	};
+	std::vector<Cut> Cuts = {{0, 1}};
+	size_t ChunkBytes = Text.size() / (NumThreads * 4) + 1;
+	int Line = 1;
+	for (size_t I = 0; I < Text.size(); ++I) {
+		if (Text[I] != '\n' && Text[I] != '\r')
+			continue;
+		++Line;
+		if (I + 1 - Cuts.back().Offset >= ChunkBytes &&
+		    StartsWithItemKeyword(Text, I + 1))
+			Cuts.push_back({I + 1, Line});
+	}
+	Cuts.push_back({Text.size(), Line});
+
+	std::vector<std::vector<TokenRec>> Chunks(Cuts.size() - 1);
+	RunOnWorkers(Chunks.size(), NumThreads, [&](size_t C) {
+		FILE *Saved = InputFile;
+		int SavedChar = LastChar;
+		SourceLocation SavedLoc = LexLoc;
+		FILE *In = fmemopen(&Text[Cuts[C].Offset],
+				    Cuts[C + 1].Offset - Cuts[C].Offset, "r");
+		ResetLexer(In);
+		LexLoc.Line = Cuts[C].Line;
+		Chunks[C] = LexAll();
+		fclose(In);
+		// only the last chunk ends the input
+		if (C + 1 < Chunks.size())
+			Chunks[C].pop_back();
+		InputFile = Saved;
+		LastChar = SavedChar;
+		LexLoc = SavedLoc;
+	});
+
+	std::vector<TokenRec> Toks;
+	size_t Size = 0;
+	for (auto &C : Chunks)
+		Size += C.size();
+	Toks.reserve(Size);
+	for (auto &C : Chunks)
+		for (auto &T : C)
+			Toks.push_back(std::move(T));
+	return Toks;
+}
+
+// TopLevelItem - result of parsing one top-level item
+struct TopLevelItem {
+	enum ItemKind { item_definition, item_extern, item_expression, item_error };
+
+	ItemKind Kind;
+	std::unique_ptr<FunctionAST> Fn;	// definitions and top-level exprs
+	std::unique_ptr<PrototypeAST> Proto;	// externs
+	size_t Allocs = 0;			// heap allocations parsing it took
+};
+
+// ParsedChunk - the items of one slice of the input and their errors
+struct ParsedChunk {
+	std::vector<TopLevelItem> Items;
+	DiagnosticsEngine Diags;
+};
+
+// parse every item in [Begin, End), mirrors MainLoop but keeps the results.
+// with a null range the tokens come straight from the lexer
+static ParsedChunk ParseItems(const TokenRec *Begin, const TokenRec *End) {
+	ParsedChunk Chunk;
+	// park the caller's errors while this chunk collects its own
+	std::swap(Chunk.Diags, Diags);
+	TokPos = Begin;
+	TokEnd = End;
+	getNextToken();
+
+	while (CurTok != tok_eof && !Diags.tooManyErrors()) {
+		TopLevelItem Item;
+		size_t Allocs = ThreadAllocs.Count;
+		switch (CurTok) {
+			case ';':
+				getNextToken();
+			continue;
+			case tok_def:
+				Item.Kind = TopLevelItem::item_definition;
+				Item.Fn = ParseDefinition();
+			break;
+			case tok_extern:
+				Item.Kind = TopLevelItem::item_extern;
+				Item.Proto = ParseExtern();
+				if (Item.Proto && Item.Proto->getArgs().size() > MaxExternArgs) {
+					LogError(diag_too_many_extern_args);
+					Item.Proto.reset();
+				}
+			break;
+			default:
+				Item.Kind = TopLevelItem::item_expression;
+				Item.Fn = ParseTopLevelExpr();
+			break;
+		}
+		if (!Item.Fn && !Item.Proto) {
+			// resynchronize at the next item for error recovery
+			Item.Kind = TopLevelItem::item_error;
+			SkipToNextItem();
+		}
+		Item.Allocs = ThreadAllocs.Count - Allocs;
+		Chunk.Items.push_back(std::move(Item));
+	}
+
+	TokPos = TokEnd = nullptr;
+	std::swap(Chunk.Diags, Diags);
+	return Chunk;
+}
+
+// pre-scan Toks for the indices where top-level items start. stray ';' and
+// the final eof start nothing, they are parsed along with the item before
+static std::vector<size_t> FindItemStarts(const std::vector<TokenRec> &Toks) {
+	std::vector<size_t> Starts;
+	for (size_t I = 0; I < Toks.size(); ++I) {
+		int Tok = Toks[I].Tok;
+		if (Tok == ';' || Tok == tok_eof)
+			continue;
+		if (I == 0 || Tok == tok_def || Tok == tok_extern ||
+		    Toks[I - 1].Tok == ';')
+			Starts.push_back(I);
+	}
+	return Starts;
+}
+
+// parse Toks on NumThreads workers, results are returned in source order.
+// errors of all chunks are collected into Diags, also in source order
+static std::vector<TopLevelItem> ParseParallel(const std::vector<TokenRec> &Toks,
+					      unsigned NumThreads) {
+	std::vector<size_t> Starts = FindItemStarts(Toks);
+	if (Starts.empty())
+		return {};
+
+	// group items into chunks of roughly equal token count. there are a few
+	// chunks per thread so that one slow chunk doesn't stall the pool
+	size_t NumChunks = std::min<size_t>(Starts.size(), NumThreads * 4);
+	size_t ChunkToks = Toks.size() / NumChunks + 1;
+	std::vector<size_t> Cuts;
+	for (size_t S : Starts)
+		if (Cuts.empty() || S - Cuts.back() >= ChunkToks)
+			Cuts.push_back(S);
+	Cuts.push_back(Toks.size());
+
+	std::vector<ParsedChunk> Results(Cuts.size() - 1);
+	RunOnWorkers(Results.size(), NumThreads, [&](size_t C) {
+		Results[C] = ParseItems(Toks.data() + Cuts[C], Toks.data() + Cuts[C + 1]);
+	});
+
+	std::vector<TopLevelItem> Items;
+	for (auto &R : Results) {
+		for (auto &Item : R.Items)
+			Items.push_back(std::move(Item));
+		Diags.append(std::move(R.Diags));
+	}
+	return Items;
+}
+
+/*******************************************************************************
+* Incremental parsing
+* each top-level item's token range is hashed, and items whose tokens didn't
+* change since the previous version of the document reuse the old AST
+*******************************************************************************/
+
+// FNV-style hash over token kinds and values, mixed a word at a time.
+// locations are left out on purpose so that an item which merely moved is
+// still reused
+static uint64_t HashTokens(const TokenRec *Begin, const TokenRec *End) {
+	uint64_t H = 14695981039346656037ULL;
+	auto Mix = [&H](uint64_t V) { H = (H ^ V) * 1099511628211ULL; };
+	for (const TokenRec *T = Begin; T != End; ++T) {
+		Mix(uint64_t(int64_t(T->Tok)));
+		if (T->Tok == tok_identifier) {
+			const std::string &S = T->IdentifierStr;
+			size_t I = 0;
+			for (; I + 8 <= S.size(); I += 8) {
+				uint64_t W;
+				memcpy(&W, S.data() + I, 8);
+				Mix(W);
+			}
+			uint64_t W = S.size();
+			memcpy(&W, S.data() + I, S.size() - I);
+			Mix(W);
+		} else if (T->Tok == tok_number) {
+			uint64_t Bits;
+			memcpy(&Bits, &T->NumVal, sizeof(Bits));
+			Mix(Bits);
+		}
+	}
+	return H ^ (H >> 32);
+}
+
+class IncrementalParser {
+	struct CacheEntry {
+		size_t NumToks;
+		std::shared_ptr<const ParsedChunk> Chunk;
+	};
+	// items without errors of the current version, by hash of their tokens
+	std::unordered_map<uint64_t, CacheEntry> Cache;
+	// every item range of the current version, keeps the results alive
+	std::vector<std::shared_ptr<const ParsedChunk>> Current;
+
+public:
+	unsigned NumReused = 0;
+	unsigned NumReparsed = 0;
+
+	// parse a new version of the document. the returned items stay valid
+	// until the next call
+	std::vector<const TopLevelItem *> update(const std::vector<TokenRec> &Toks);
+};
+
+std::vector<const TopLevelItem *>
+IncrementalParser::update(const std::vector<TokenRec> &Toks) {
+	std::vector<size_t> Starts = FindItemStarts(Toks);
+	Starts.push_back(Toks.size());
+
+	std::unordered_map<uint64_t, CacheEntry> NewCache(Starts.size());
+	std::vector<std::shared_ptr<const ParsedChunk>> NewCurrent;
+	NewCurrent.reserve(Starts.size());
+	std::vector<const TopLevelItem *> Items;
+	Items.reserve(Starts.size());
+	NumReused = NumReparsed = 0;
+
+	for (size_t I = 0; I + 1 < Starts.size(); ++I) {
+		const TokenRec *Begin = Toks.data() + Starts[I];
+		const TokenRec *End = Toks.data() + Starts[I + 1];
+		size_t NumToks = End - Begin;
+		uint64_t H = HashTokens(Begin, End);
+
+		std::shared_ptr<const ParsedChunk> Chunk;
+		auto It = Cache.find(H);
+		if (It != Cache.end() && It->second.NumToks == NumToks) {
+			Chunk = It->second.Chunk;
+			NewCache[H] = It->second;
+			++NumReused;
+		} else {
+			auto Parsed = std::make_shared<ParsedChunk>(ParseItems(Begin, End));
+			++NumReparsed;
+			// broken items are not cached, so their errors are reported again
+			// with current locations the next time around
+			if (Parsed->Diags.hasErrors())
+				Diags.append(std::move(Parsed->Diags));
+			else
+				NewCache[H] = {NumToks, Parsed};
+			Chunk = std::move(Parsed);
+		}
+
+		for (auto &Item : Chunk->Items)
+			Items.push_back(&Item);
+		NewCurrent.push_back(std::move(Chunk));
+	}
+
+	// only the current version is kept, items that went away are freed
+	Cache.swap(NewCache);
+	Current.swap(NewCurrent);
+	return Items;
+}
+
+// handle items that were parsed ahead in source order, the way MainLoop
+// handles each one as soon as it is parsed
+static void HandleItems(std::vector<TopLevelItem> &Items) {
+	for (auto &Item : Items) {
+		if (FlushErrors())
+			return;
+		switch (Item.Kind) {
+			case TopLevelItem::item_definition:
+				HandleParsedDefinition(std::move(Item.Fn), Item.Allocs);
+			break;
+			case TopLevelItem::item_extern:
+				HandleParsedExtern(*Item.Proto, Item.Allocs);
+			break;
+			case TopLevelItem::item_expression:
+				HandleParsedExpression(*Item.Fn, Item.Allocs);
+			break;
+			case TopLevelItem::item_error:
+			break;
+		}
+	}
+	FlushErrors();
+}
+
+// the parsed items of the emit modes, which don't run them
+static void ReportItems(const std::vector<TopLevelItem> &Items) {
+	for (auto &Item : Items) {
+		switch (Item.Kind) {
+			case TopLevelItem::item_definition:
+				fprintf(stderr, "Parsed a function definition.\n");
+			break;
+			case TopLevelItem::item_extern:
+				fprintf(stderr, "Parsed an extern.\n");
+			break;
+			case TopLevelItem::item_expression:
+				fprintf(stderr, "Parsed a top-level expr.\n");
+			break;
+			case TopLevelItem::item_error:
+			break;
+		}
+		if (DumpAST && Item.Fn)
+			DumpFunction(*Item.Fn, stderr);
+		if (ShowASTStats && Item.Kind != TopLevelItem::item_error)
+			ReportASTStats(Item.Fn.get(), Item.Proto.get(), Item.Allocs);
+	}
+}
+
+/*******************************************************************************
+* Binary AST images
+* a parsed module written as one position independent blob that is checked
+* in place after mmap. all references are indices or byte offsets from the
+* start of the image, never pointers. the expression nodes are the hash-consed
+* DAGNodes of the whole module, children always come before their parents.
+* loading still builds a tree from each body for the backends
+*
+*   ImageHeader | ImageFunction[] | DAGNode[] | uint32 operands[] |
+*   uint32 params[] | uint32 name offsets[] | name strings
+*******************************************************************************/
+
+static const char ImageMagic[4] = {'C', 'H', 'A', 'B'};
+// 2 added if nodes
+static const uint16_t ImageVersion = 2;
+// written as 0x0102, reads back as 0x0201 on a host of the other byte order
+static const uint16_t ImageByteOrder = 0x0102;
+// the trees loading builds from shared nodes can be exponentially larger than
+// the image, and they are walked recursively. images whose trees would get
+// past these limits are rejected
+static const uint64_t MaxImageTreeNodes = 1 << 22;
+static const uint32_t MaxImageTreeDepth = 1 << 14;
+
+struct ImageHeader {
+	char Magic[4];
+	uint16_t Version;
+	uint16_t ByteOrder;
+	uint32_t NumFunctions;
+	uint32_t NumNodes;
+	uint32_t NumOperands;
+	uint32_t NumParams;
+	uint32_t NumNames;
+	uint32_t Reserved;
+	// byte offsets of the sections
+	uint64_t FunctionsOffset;
+	uint64_t NodesOffset;
+	uint64_t OperandsOffset;
+	uint64_t ParamsOffset;
+	uint64_t NameOffsetsOffset;
+	uint64_t StringsOffset;
+	uint64_t Size;
+};
+
+struct ImageFunction {
+	uint32_t Kind;		// a TopLevelItem::ItemKind
+	uint32_t Name;		// index into the name table
+	uint32_t Params;	// first entry in the params section
+	uint32_t NumParams;
+	uint32_t Body;		// root node, ~0u for externs
+	uint32_t Reserved;
+};
+
+static_assert(sizeof(ImageHeader) == 88, "image header layout changed");
+static_assert(sizeof(ImageFunction) == 24, "image function layout changed");
+static_assert(sizeof(DAGNode) == 24, "image node layout changed");
+
+// an image is turned back into trees when it is loaded, so a shared call
+// node still runs once per occurrence and any call can be shared
+static bool AnyCallee(const std::string &) { return true; }
+
+// write Items as an image to Path, returns false on I/O errors
+static bool WriteASTImage(const std::vector<TopLevelItem> &Items,
+			  const char *Path) {
+	ExprDAG DAG(AnyCallee);
+	std::vector<ImageFunction> Functions;
+	std::vector<uint32_t> Params;
+
+	for (auto &Item : Items) {
+		if (Item.Kind == TopLevelItem::item_error)
+			continue;
+		const PrototypeAST &Proto = Item.Fn ? Item.Fn->getProto() : *Item.Proto;
+		ImageFunction F = {uint32_t(Item.Kind), DAG.addName(Proto.getName()),
+				   uint32_t(Params.size()), Proto.getArgs().size(), ~0u, 0};
+		for (auto &Arg : Proto.getArgs())
+			Params.push_back(DAG.addName(Arg));
+		if (Item.Fn)
+			F.Body = DAG.add(Item.Fn->getBody());
+		Functions.push_back(F);
+	}
+
+	std::vector<uint32_t> NameOffsets;
+	std::string Strings;
+	for (auto &Name : DAG.getNames()) {
+		NameOffsets.push_back(Strings.size());
+		Strings.append(Name.c_str(), Name.size() + 1);
+	}
+
+	auto &Nodes = DAG.getNodes();
+	auto &Operands = DAG.getOperands();
+	auto Align = [](uint64_t Off) { return (Off + 7) & ~uint64_t(7); };
+
+	ImageHeader H;
+	memset(&H, 0, sizeof(H));
+	memcpy(H.Magic, ImageMagic, sizeof(H.Magic));
+	H.Version = ImageVersion;
+	H.ByteOrder = ImageByteOrder;
+	H.NumFunctions = Functions.size();
+	H.NumNodes = Nodes.size();
+	H.NumOperands = Operands.size();
+	H.NumParams = Params.size();
+	H.NumNames = NameOffsets.size();
+	H.FunctionsOffset = sizeof(H);
+	H.NodesOffset = Align(H.FunctionsOffset + Functions.size() * sizeof(ImageFunction));
+	H.OperandsOffset = Align(H.NodesOffset + Nodes.size() * sizeof(DAGNode));
+	H.ParamsOffset = Align(H.OperandsOffset + Operands.size() * sizeof(uint32_t));
+	H.NameOffsetsOffset = Align(H.ParamsOffset + Params.size() * sizeof(uint32_t));
+	H.StringsOffset = Align(H.NameOffsetsOffset + NameOffsets.size() * sizeof(uint32_t));
+	H.Size = H.StringsOffset + Strings.size();
+
+	FILE *F = fopen(Path, "wb");
+	if (!F)
+		return false;
+	bool OK = true;
+	auto Put = [&](uint64_t Offset, const void *Data, size_t Len) {
+		// zero padding up to the section start
+		static const char Zeros[8] = {};
+		long Pad = long(Offset) - ftell(F);
+		if (Pad > 0)
+			OK &= fwrite(Zeros, 1, Pad, F) == size_t(Pad);
+		if (Len)
+			OK &= fwrite(Data, 1, Len, F) == Len;
+	};
+	Put(0, &H, sizeof(H));
+	Put(H.FunctionsOffset, Functions.data(), Functions.size() * sizeof(ImageFunction));
+	Put(H.NodesOffset, Nodes.data(), Nodes.size() * sizeof(DAGNode));
+	Put(H.OperandsOffset, Operands.data(), Operands.size() * sizeof(uint32_t));
+	Put(H.ParamsOffset, Params.data(), Params.size() * sizeof(uint32_t));
+	Put(H.NameOffsetsOffset, NameOffsets.data(), NameOffsets.size() * sizeof(uint32_t));
+	Put(H.StringsOffset, Strings.data(), Strings.size());
+	return fclose(F) == 0 && OK;
+}
+
+// ASTImage - read-only view of an image mapped into memory. the accessors
+// read straight from the mapping, trees are only built by buildExpr
+class ASTImage {
+	void *Base = MAP_FAILED;
+	size_t Size = 0;
+
+	const char *bytes() const { return static_cast<const char *>(Base); }
+	template <typename T>
+	const T *section(uint64_t Offset) const {
+		return reinterpret_cast<const T *>(bytes() + Offset);
+	}
+	const char *verify() const;
+
+public:
+	ASTImage() = default;
+	ASTImage(const ASTImage &) = delete;
+	ASTImage &operator=(const ASTImage &) = delete;
+	~ASTImage() {
+		if (Base != MAP_FAILED)
+			munmap(Base, Size);
+	}
+
+	// map Path, on failure returns false and sets Err
+	bool open(const char *Path, const char **Err);
+
+	const ImageHeader &getHeader() const { return *section<ImageHeader>(0); }
+	uint32_t getNumFunctions() const { return getHeader().NumFunctions; }
+	const ImageFunction &getFunction(uint32_t I) const {
+		return section<ImageFunction>(getHeader().FunctionsOffset)[I];
+	}
+	const DAGNode &getNode(uint32_t I) const {
+		return section<DAGNode>(getHeader().NodesOffset)[I];
+	}
+	const uint32_t *getCallArgs(const DAGNode &N) const {
+		return section<uint32_t>(getHeader().OperandsOffset) + N.B;
+	}
+	const uint32_t *getParams(const ImageFunction &F) const {
+		return section<uint32_t>(getHeader().ParamsOffset) + F.Params;
+	}
+	const char *getName(uint32_t I) const {
+		const uint32_t *Offsets = section<uint32_t>(getHeader().NameOffsetsOffset);
+		return section<char>(getHeader().StringsOffset) + Offsets[I];
+	}
+
+	// build an AST for function I, for code that wants the tree form
+	std::unique_ptr<ExprAST> buildExpr(uint32_t Node) const;
+	std::unique_ptr<PrototypeAST> buildProto(uint32_t I) const;
+};
+
+bool ASTImage::open(const char *Path, const char **Err) {
+	int FD = ::open(Path, O_RDONLY);
+	struct stat St;
+	if (FD < 0 || fstat(FD, &St) < 0) {
+		if (FD >= 0)
+			close(FD);
+		*Err = "cannot open file";
+		return false;
+	}
+	Size = St.st_size;
+	if (Size >= sizeof(ImageHeader))
+		Base = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, FD, 0);
+	close(FD);
+	if (Base == MAP_FAILED) {
+		*Err = "not an AST image";
+		return false;
+	}
+	*Err = verify();
+	return !*Err;
+}
+
+// check the header and that every index stays inside its section, so the
+// accessors above can't read outside the mapping. children must come before
+// their parents, which also rules out cycles, and the trees of the bodies
+// have to stay within MaxImageTreeNodes and MaxImageTreeDepth
+const char *ASTImage::verify() const {
+	const ImageHeader &H = getHeader();
+	if (memcmp(H.Magic, ImageMagic, sizeof(H.Magic)))
+		return "not an AST image";
+	if (H.ByteOrder != ImageByteOrder)
+		return "AST image has the wrong byte order";
+	if (H.Version != ImageVersion)
+		return "unsupported AST image version";
+
+	auto Fits = [&](uint64_t Offset, uint64_t Count, uint64_t EltSize) {
+		return Offset % 8 == 0 && Offset <= Size &&
+		       Count <= (Size - Offset) / EltSize;
+	};
+	if (H.Size != Size ||
+	    !Fits(H.FunctionsOffset, H.NumFunctions, sizeof(ImageFunction)) ||
+	    !Fits(H.NodesOffset, H.NumNodes, sizeof(DAGNode)) ||
+	    !Fits(H.OperandsOffset, H.NumOperands, sizeof(uint32_t)) ||
+	    !Fits(H.ParamsOffset, H.NumParams, sizeof(uint32_t)) ||
+	    !Fits(H.NameOffsetsOffset, H.NumNames, sizeof(uint32_t)) ||
+	    H.StringsOffset > Size || (H.NumNames && bytes()[Size - 1] != 0))
+		return "truncated AST image";
+
+	const uint32_t *NameOffsets = section<uint32_t>(H.NameOffsetsOffset);
+	for (uint32_t I = 0; I < H.NumNames; ++I)
+		if (NameOffsets[I] >= Size - H.StringsOffset)
+			return "bad name in AST image";
+
+	const uint32_t *Operands = section<uint32_t>(H.OperandsOffset);
+	// tree size, saturated just past the limit, and depth of every node
+	std::vector<uint64_t> TreeNodes(H.NumNodes);
+	std::vector<uint32_t> TreeDepth(H.NumNodes);
+	for (uint32_t I = 0; I < H.NumNodes; ++I) {
+		const DAGNode &N = getNode(I);
+		uint64_t Nodes = 1;
+		uint32_t Depth = 0;
+		auto AddChild = [&](uint32_t Child) {
+			Nodes += TreeNodes[Child];
+			Depth = std::max(Depth, TreeDepth[Child]);
+		};
+		switch (N.Kind) {
+			case DAGNode::dag_number:
+			break;
+			case DAGNode::dag_variable:
+				if (N.A >= H.NumNames)
+					return "bad node in AST image";
+			break;
+			case DAGNode::dag_binary:
+				if (N.A >= I || N.B >= I)
+					return "bad node in AST image";
+				AddChild(N.A);
+				AddChild(N.B);
+			break;
+			case DAGNode::dag_call:
+				if (N.A >= H.NumNames || N.B > H.NumOperands ||
+				    N.C > H.NumOperands - N.B)
+					return "bad node in AST image";
+				for (uint32_t J = 0; J < N.C; ++J) {
+					if (Operands[N.B + J] >= I)
+						return "bad node in AST image";
+					AddChild(Operands[N.B + J]);
+				}
+			break;
+			case DAGNode::dag_if:
+				if (N.A >= I || N.B >= I || N.C >= I)
+					return "bad node in AST image";
+				AddChild(N.A);
+				AddChild(N.B);
+				AddChild(N.C);
+			break;
+			default:
+				return "bad node in AST image";
+		}
+		if (Depth >= MaxImageTreeDepth)
+			return "AST image expands to too deep a tree";
+		TreeNodes[I] = std::min(Nodes, MaxImageTreeNodes + 1);
+		TreeDepth[I] = Depth + 1;
+	}
+
+	uint64_t Nodes = 0;
+	for (uint32_t I = 0; I < H.NumFunctions; ++I) {
+		const ImageFunction &F = getFunction(I);
+		if (F.Kind > TopLevelItem::item_expression || F.Name >= H.NumNames ||
+		    F.Params > H.NumParams || F.NumParams > H.NumParams - F.Params ||
+		    (F.Body >= H.NumNodes && F.Body != ~0u) ||
+		    (F.Body == ~0u) != (F.Kind == TopLevelItem::item_extern))
+			return "bad function in AST image";
+		for (uint32_t J = 0; J < F.NumParams; ++J)
+			if (getParams(F)[J] >= H.NumNames)
+				return "bad function in AST image";
+		if (F.Body != ~0u && (Nodes += TreeNodes[F.Body]) > MaxImageTreeNodes)
+			return "AST image expands to too many nodes";
+	}
+	return nullptr;
+}
+
+std::unique_ptr<ExprAST> ASTImage::buildExpr(uint32_t Node) const {
+	const DAGNode &N = getNode(Node);
+	switch (N.Kind) {
+		case DAGNode::dag_number:
+			return std::make_unique<NumberExprAST>(N.Val);
+		case DAGNode::dag_variable:
+			return std::make_unique<VariableExprAST>(getName(N.A));
+		case DAGNode::dag_binary:
+			return std::make_unique<BinaryExprAST>(N.Op, buildExpr(N.A),
+							       buildExpr(N.B));
+		case DAGNode::dag_if:
+			return std::make_unique<IfExprAST>(buildExpr(N.A), buildExpr(N.B),
+							   buildExpr(N.C));
+		case DAGNode::dag_call:
+		break;
+	}
+	ExprList Args;
+	for (uint32_t I = 0; I < N.C; ++I)
+		Args.push_back(buildExpr(getCallArgs(N)[I]));
+	return std::make_unique<CallExprAST>(getName(N.A), std::move(Args));
+}
+
+std::unique_ptr<PrototypeAST> ASTImage::buildProto(uint32_t I) const {
+	const ImageFunction &F = getFunction(I);
+	NameList Args;
+	for (uint32_t J = 0; J < F.NumParams; ++J)
+		Args.push_back(getName(getParams(F)[J]));
+	return std::make_unique<PrototypeAST>(getName(F.Name), std::move(Args));
+}
+
+// handle the items of the image at Path in order, as if its source had been
+// read, so the input that follows can call its functions. false if it can't
+// be mapped
+static bool LoadASTImage(const char *Path) {
+	ASTImage Image;
+	const char *Err;
+	if (!Image.open(Path, &Err)) {
+		fprintf(stderr, "error: %s: %s\n", Path, Err);
+		return false;
+	}
+	fprintf(stderr, "Loaded %u functions, %u expression nodes.\n",
+		Image.getNumFunctions(), Image.getHeader().NumNodes);
+
+	InputName = Path;
+	for (uint32_t I = 0; I < Image.getNumFunctions(); ++I) {
+		const ImageFunction &F = Image.getFunction(I);
+		auto Proto = Image.buildProto(I);
+		if (F.Kind == TopLevelItem::item_extern) {
+			DeclareExtern(*Proto);
+			continue;
+		}
+		auto Fn = std::make_unique<FunctionAST>(std::move(Proto),
+							Image.buildExpr(F.Body));
+		if (DumpAST)
+			DumpFunction(*Fn, stderr);
+		if (F.Kind == TopLevelItem::item_expression)
+			RunExpression(*Fn);
+		else
+			DefineFunction(std::move(Fn));
+		Diags.flush(stderr);
+	}
+	InputName = nullptr;
+	return true;
+}
+
+// move the definitions and externs among Items into the function table for
+// compiling them as a whole, a later definition replaces an earlier one.
+// top-level expressions are resolved and stay where they are. false after
+// reporting errors
+static bool DefineItems(std::vector<TopLevelItem> &Items) {
+	for (auto &Item : Items) {
+		if (Item.Kind == TopLevelItem::item_extern)
+			Functions.declareExtern(*Item.Proto);
+		else if (Item.Kind == TopLevelItem::item_definition && Item.Fn &&
+			 ResolveFunction(Functions, *Item.Fn))
+			Functions.define(std::move(Item.Fn));
+	}
+	for (size_t I = 0; I < Functions.size(); ++I)
+		InlineFunction(Functions, Functions.get(I));
+	for (auto &Item : Items)
+		if (Item.Kind == TopLevelItem::item_expression)
+			ResolveFunction(Functions, *Item.Fn);
+	Diags.flush(stderr);
+	return !Diags.hasErrors();
+}
+
+/*******************************************************************************
+* Native object files
+* definitions compiled ahead of time to an x86-64 ELF object, each a global
+* symbol with the C signature double name(double, ...), and a C header
+* declaring them. a shared library is linked from the object by the system C
+* compiler. this is the JIT's code without its run-time checks, so recursion
+* that is too deep overflows the native stack as it would in C
+*******************************************************************************/
+
+// keywords of C and, as the headers are also included from C++, of C++.
+// Chalice identifiers have no underscores, so these are all that can clash
+static bool IsCKeyword(const std::string &Name) {
+	static const std::set<std::string> Keywords = {
+		"auto", "break", "case", "char", "const", "continue", "default",
+		"do", "double", "else", "enum", "extern", "float", "for", "goto",
+		"if", "inline", "int", "long", "register", "restrict", "return",
+		"short", "signed", "sizeof", "static", "struct", "switch",
+		"typedef", "union", "unsigned", "void", "volatile", "while",
+		"alignas", "alignof", "bool", "constexpr", "false", "nullptr",
+		"true", "typeof",
+		"and", "asm", "bitand", "bitor", "catch", "class", "compl",
+		"concept", "consteval", "constinit", "decltype", "delete",
+		"explicit", "export", "friend", "mutable", "namespace", "new",
+		"noexcept", "not", "operator", "or", "private", "protected",
+		"public", "requires", "template", "this", "throw", "try", "typeid",
+		"typename", "using", "virtual", "xor"};
+	return Keywords.count(Name);
+}
+
+// parameter names that C would take for keywords get a trailing underscore.
+// function names have to stay as they are, so keywords among them are errors
+static std::string CParamName(const std::string &Name) {
+	return IsCKeyword(Name) ? Name + "_" : Name;
+}
+
+#ifdef CHALICE_HAVE_JIT
+
+// a function in .text
+struct NativeSymbol {
+	std::string Name;
+	size_t Offset;
+	size_t Size;
+};
+
+// write a relocatable object of Text, defining Defs. relocations against
+// symbols that aren't defined there are left to the linker
+static bool WriteELFObject(const char *Path, const std::vector<uint8_t> &Text,
+			   const std::vector<NativeSymbol> &Defs,
+			   const std::vector<NativeReloc> &Relocs) {
+	// every symbol is global, so .symtab has no locals after the null one
+	std::string StrTab(1, '\0');
+	std::vector<Elf64_Sym> Syms(1);
+	std::unordered_map<std::string, uint32_t> SymIndex;
+	auto AddSym = [&](const std::string &Name, uint16_t Section, uint8_t Type,
+			  size_t Value, size_t Size) {
+		Elf64_Sym S;
+		memset(&S, 0, sizeof(S));
+		S.st_name = StrTab.size();
+		S.st_info = ELF64_ST_INFO(STB_GLOBAL, Type);
+		S.st_shndx = Section;
+		S.st_value = Value;
+		S.st_size = Size;
+		StrTab.append(Name.c_str(), Name.size() + 1);
+		SymIndex[Name] = Syms.size();
+		Syms.push_back(S);
+	};
+	for (auto &D : Defs)
+		AddSym(D.Name, 1, STT_FUNC, D.Offset, D.Size);
+
+	std::vector<Elf64_Rela> Relas;
+	for (auto &R : Relocs) {
+		if (!SymIndex.count(R.Symbol))
+			AddSym(R.Symbol, SHN_UNDEF, STT_NOTYPE, 0, 0);
+		Elf64_Rela Rela;
+		Rela.r_offset = R.Offset;
+		Rela.r_info = ELF64_R_INFO(SymIndex[R.Symbol], R_X86_64_PLT32);
+		// rel32 is relative to the end of the call
+		Rela.r_addend = -4;
+		Relas.push_back(Rela);
+	}
+
+	enum { sec_text = 1, sec_rela, sec_symtab, sec_strtab, sec_shstrtab, sec_note };
+	const char *Names[] = {".text", ".rela.text", ".symtab", ".strtab",
+			       ".shstrtab", ".note.GNU-stack"};
+	std::string ShStrTab(1, '\0');
+	std::vector<Elf64_Shdr> Sections(1);
+	memset(&Sections[0], 0, sizeof(Elf64_Shdr));
+	for (const char *Name : Names) {
+		Elf64_Shdr Sh;
+		memset(&Sh, 0, sizeof(Sh));
+		Sh.sh_name = ShStrTab.size();
+		Sh.sh_addralign = 1;
+		ShStrTab.append(Name, strlen(Name) + 1);
+		Sections.push_back(Sh);
+	}
+	struct {
+		uint32_t Type;
+		uint64_t Flags;
+		uint32_t Link, Info;
+		uint64_t Align, EntSize;
+		const void *Data;
+		size_t Size;
+	} Contents[] = {
+		{SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 0, 0, 16, 0,
+		 Text.data(), Text.size()},
+		{SHT_RELA, SHF_INFO_LINK, sec_symtab, sec_text, 8, sizeof(Elf64_Rela),
+		 Relas.data(), Relas.size() * sizeof(Elf64_Rela)},
+		{SHT_SYMTAB, 0, sec_strtab, 1, 8, sizeof(Elf64_Sym),
+		 Syms.data(), Syms.size() * sizeof(Elf64_Sym)},
+		{SHT_STRTAB, 0, 0, 0, 1, 0, StrTab.data(), StrTab.size()},
+		{SHT_STRTAB, 0, 0, 0, 1, 0, ShStrTab.data(), ShStrTab.size()},
+		// empty, it just says the stack needn't be executable
+		{SHT_PROGBITS, 0, 0, 0, 1, 0, nullptr, 0},
+	};
+
+	uint64_t Offset = sizeof(Elf64_Ehdr);
+	for (unsigned I = 0; I < sizeof(Contents) / sizeof(Contents[0]); ++I) {
+		auto &C = Contents[I];
+		Elf64_Shdr &Sh = Sections[I + 1];
+		Offset = (Offset + C.Align - 1) & ~(C.Align - 1);
+		Sh.sh_type = C.Type;
+		Sh.sh_flags = C.Flags;
+		Sh.sh_offset = Offset;
+		Sh.sh_size = C.Size;
+		Sh.sh_link = C.Link;
+		Sh.sh_info = C.Info;
+		Sh.sh_addralign = C.Align;
+		Sh.sh_entsize = C.EntSize;
+		Offset += C.Size;
+	}
+
+	Elf64_Ehdr H;
+	memset(&H, 0, sizeof(H));
+	memcpy(H.e_ident, ELFMAG, SELFMAG);
+	H.e_ident[EI_CLASS] = ELFCLASS64;
+	H.e_ident[EI_DATA] = ELFDATA2LSB;
+	H.e_ident[EI_VERSION] = EV_CURRENT;
+	H.e_type = ET_REL;
+	H.e_machine = EM_X86_64;
+	H.e_version = EV_CURRENT;
+	H.e_shoff = (Offset + 7) & ~uint64_t(7);
+	H.e_ehsize = sizeof(Elf64_Ehdr);
+	H.e_shentsize = sizeof(Elf64_Shdr);
+	H.e_shnum = Sections.size();
+	H.e_shstrndx = sec_shstrtab;
+
+	FILE *F = fopen(Path, "wb");
+	if (!F)
+		return false;
+	bool OK = true;
+	auto Put = [&](uint64_t Offset, const void *Data, size_t Len) {
+		// zero padding up to the section start
+		static const char Zeros[16] = {};
+		long Pad = long(Offset) - ftell(F);
+		if (Pad > 0)
+			OK &= fwrite(Zeros, 1, Pad, F) == size_t(Pad);
+		if (Len)
+			OK &= fwrite(Data, 1, Len, F) == Len;
+	};
+	Put(0, &H, sizeof(H));
+	for (unsigned I = 0; I < sizeof(Contents) / sizeof(Contents[0]); ++I)
+		Put(Sections[I + 1].sh_offset, Contents[I].Data, Contents[I].Size);
+	Put(H.e_shoff, Sections.data(), Sections.size() * sizeof(Elf64_Shdr));
+	return fclose(F) == 0 && OK;
+}
+
+// write a C header declaring Defs, guarded by a macro made from its name
+static bool WriteNativeHeader(const std::string &Path,
+			      const std::vector<const FunctionEntry *> &Defs) {
+	std::string Guard = "CHALICE_";
+	for (char Ch : Path.substr(Path.rfind('/') + 1))
+		Guard += isalnum(Ch) ? toupper(Ch) : '_';
+
+	FILE *F = fopen(Path.c_str(), "w");
+	if (!F)
+		return false;
+	fprintf(F, "/* generated by chalice, do not edit */\n"
+		   "#ifndef %s\n#define %s\n\n"
+		   "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n",
+		Guard.c_str(), Guard.c_str());
+	for (const FunctionEntry *D : Defs) {
+		fprintf(F, "double %s(", D->Name.c_str());
+		auto &Args = D->AST->getProto().getArgs();
+		for (size_t I = 0; I < Args.size(); ++I)
+			fprintf(F, "%sdouble %s", I ? ", " : "",
+				CParamName(Args[I]).c_str());
+		fprintf(F, "%s);\n", Args.empty() ? "void" : "");
+	}
+	fprintf(F, "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n");
+	return fclose(F) == 0;
+}
+
+// link the object Obj into the shared library Path with $CC, or cc
+static bool LinkSharedLibrary(const char *Obj, const char *Path) {
+	const char *CC = getenv("CC");
+	if (!CC || !*CC)
+		CC = "cc";
+	pid_t Pid = fork();
+	if (Pid < 0)
+		return false;
+	if (!Pid) {
+		execlp(CC, CC, "-shared", "-o", Path, Obj, "-lm", (char *)nullptr);
+		fprintf(stderr, "error: cannot run '%s'\n", CC);
+		_exit(127);
+	}
+	int Status;
+	if (waitpid(Pid, &Status, 0) < 0)
+		return false;
+	return WIFEXITED(Status) && WEXITSTATUS(Status) == 0;
+}
+
+// compile the definitions among Items to Path, an object file or, if it ends
+// in .so, a shared library. the header goes next to it with the extension
+// replaced by .h. top-level expressions are left out, a later definition of
+// the same name replaces an earlier one
+static bool WriteNativeObject(std::vector<TopLevelItem> &Items, const char *Path) {
+	if (!DefineItems(Items))
+		return false;
+
+	std::vector<uint8_t> Text;
+	std::vector<NativeSymbol> Syms;
+	std::vector<NativeReloc> Relocs;
+	std::vector<const FunctionEntry *> Defs;
+	for (size_t I = 0; I < Functions.size(); ++I) {
+		const FunctionEntry &F = Functions.get(I);
+		if ((F.AST || F.Extern) && IsCKeyword(F.Name)) {
+			fprintf(stderr, "error: '%s' can't be a function in C\n",
+				F.Name.c_str());
+			return false;
+		}
+		if (!F.AST)
+			continue;
+		X86Emitter E;
+		E.Buf.swap(Text);
+		E.Relocs = &Relocs;
+		size_t Start = E.Buf.size();
+		if (!EmitNativeFunction(*F.AST, E)) {
+			if (E.BadCallee)
+				fprintf(stderr, "error: '%s' calls '%s', which is not "
+					"declared with that many parameters\n",
+					F.Name.c_str(), E.BadCallee->Name.c_str());
+			else
+				fprintf(stderr, "error: '%s' has more than %u "
+					"parameters or arguments\n", F.Name.c_str(),
+					MaxJITArgs);
+			return false;
+		}
+		Syms.push_back({F.Name, Start, E.Buf.size() - Start});
+		Defs.push_back(&F);
+		// int3 up to the next function
+		E.Buf.resize((E.Buf.size() + 15) & ~size_t(15), 0xCC);
+		E.Buf.swap(Text);
+	}
+
+	std::string Out = Path;
+	size_t Dot = Out.rfind('.');
+	if (Dot == std::string::npos || Out.find('/', Dot) != std::string::npos)
+		Dot = Out.size();
+	std::string Header = Out.substr(0, Dot) + ".h";
+	if (!WriteNativeHeader(Header, Defs)) {
+		fprintf(stderr, "error: cannot write '%s'\n", Header.c_str());
+		return false;
+	}
+
+	bool Shared = Out.compare(Dot, std::string::npos, ".so") == 0;
+	std::string Obj = Out;
+	if (Shared) {
+		char Temp[] = "/tmp/chalice-XXXXXX.o";
+		int FD = mkstemps(Temp, 2);
+		if (FD < 0) {
+			fprintf(stderr, "error: cannot create a temporary file\n");
+			return false;
+		}
+		close(FD);
+		Obj = Temp;
+	}
+	if (!WriteELFObject(Obj.c_str(), Text, Syms, Relocs)) {
+		fprintf(stderr, "error: cannot write '%s'\n", Obj.c_str());
+		return false;
+	}
+	if (Shared) {
+		bool OK = LinkSharedLibrary(Obj.c_str(), Path);
+		unlink(Obj.c_str());
+		if (!OK) {
+			fprintf(stderr, "error: cannot link '%s'\n", Path);
+			return false;
+		}
+	}
+	fprintf(stderr, "Wrote %zu functions to %s and %s.\n", Defs.size(), Path,
+		Header.c_str());
+	return true;
+}
+
+#endif // CHALICE_HAVE_JIT
+
+/*******************************************************************************
+* C source
+* the whole module as one self-contained C file for the system compiler, with
+* every definition an exported function of the same name. top-level
+* expressions go to a main() that prints them like the interpreter does,
+* with the final version of every function
+*******************************************************************************/
+
+// a double literal that reads back as V
+static std::string CNumber(double V) {
+	if (V != V)
+		return "(0.0 / 0.0)";
+	if (V > 1.7976931348623157e308)
+		return "(1.0 / 0.0)";
+	if (V < -1.7976931348623157e308)
+		return "(-1.0 / 0.0)";
+	char Buf[32];
+	snprintf(Buf, sizeof(Buf), "%.17g", V);
+	std::string S = Buf;
+	if (S.find_first_of(".e") == std::string::npos)
+		S += ".0";
+	return S;
+}
+
+// CEmitter - visitor appending an expression to Out, fully parenthesized.
+// a call that can't be linked leaves its callee in BadCallee
+struct CEmitter {
+	std::string &Out;
+	const NameList &Params;
+	const FunctionEntry *BadCallee = nullptr;
+
+	bool operator()(const NumberExprAST &E) {
+		Out += CNumber(E.getVal());
+		return true;
+	}
+
+	bool operator()(const VariableExprAST &E) {
+		Out += CParamName(Params[E.getSlot()]);
+		return true;
+	}
+
+	bool operator()(const BinaryExprAST &E) {
+		Out += E.getOp() == '<' ? "(double)(" : "(";
+		if (!visit(E.getLHS(), *this))
+			return false;
+		Out += ' ';
+		Out += E.getOp();
+		Out += ' ';
+		if (!visit(E.getRHS(), *this))
+			return false;
+		Out += ')';
+		return true;
+	}
+
+	bool operator()(const CallExprAST &E) {
+		const FunctionEntry &Callee = Functions.get(E.getCalleeIndex());
+		if (!(Callee.Defined || Callee.Extern) ||
+		    Callee.NumParams != E.getArgs().size()) {
+			BadCallee = &Callee;
+			return false;
+		}
+		Out += Callee.Name + "(";
+		for (size_t I = 0; I < E.getArgs().size(); ++I) {
+			if (I)
+				Out += ", ";
+			if (!visit(*E.getArgs()[I], *this))
+				return false;
+		}
+		Out += ')';
+		return true;
+	}
+
+	bool operator()(const IfExprAST &E) {
+		// a comparison is already false for NaN
+		auto *B = dyn_cast<BinaryExprAST>(&E.getCond());
+		if (B && B->getOp() == '<') {
+			Out += "((";
+			if (!visit(B->getLHS(), *this))
+				return false;
+			Out += " < ";
+			if (!visit(B->getRHS(), *this))
+				return false;
+			Out += ") ? ";
+		} else {
+			Out += "(chalice_true(";
+			if (!visit(E.getCond(), *this))
+				return false;
+			Out += ") ? ";
+		}
+		if (!visit(E.getThen(), *this))
+			return false;
+		Out += " : ";
+		if (!visit(E.getElse(), *this))
+			return false;
+		Out += ')';
+		return true;
+	}
+};
+
+// double name(double a, double b) for a table entry
+static std::string CSignature(const FunctionEntry &F, const NameList &Params) {
+	std::string S = "double " + F.Name + "(";
+	for (size_t I = 0; I < Params.size(); ++I)
+		S += (I ? ", double " : "double ") + CParamName(Params[I]);
+	return S + (Params.empty() ? "void)" : ")");
+}
+
+// write Items as C to Path
+static bool WriteCSource(std::vector<TopLevelItem> &Items, const char *Path) {
+	if (!DefineItems(Items))
+		return false;
+
+	std::string Out = "/* generated by chalice, build with\n"
+			  " *   cc -O2 -march=native -ffp-contract=off -c file.c\n"
+			  " * without -ffp-contract=off, a * b + c may become a fused\n"
+			  " * multiply-add, which rounds differently than chalice does.\n"
+			  " * define CHALICE_NO_MAIN to leave out main() */\n\n"
+			  "#include <stdio.h>\n\n"
+			  "/* if: neither zero nor NaN */\n"
+			  "static inline int chalice_true(double v) "
+			  "{ return v < 0.0 || v > 0.0; }\n\n";
+	std::vector<const FunctionEntry *> Defs;
+	for (size_t I = 0; I < Functions.size(); ++I) {
+		const FunctionEntry &F = Functions.get(I);
+		if ((F.AST || F.Extern) && IsCKeyword(F.Name)) {
+			fprintf(stderr, "error: '%s' can't be a function in C\n",
+				F.Name.c_str());
+			return false;
+		}
+		if (F.AST)
+			Defs.push_back(&F);
+		else if (F.Extern) {
+			NameList Params;
+			for (unsigned J = 0; J < F.NumParams; ++J)
+				Params.push_back("x" + std::to_string(J));
+			Out += CSignature(F, Params) + ";\n";
+		}
+	}
+	for (const FunctionEntry *F : Defs)
+		Out += CSignature(*F, F->AST->getProto().getArgs()) + ";\n";
+
+	auto Emit = [&](const std::string &Name, const FunctionAST &Fn) {
+		CEmitter E = {Out, Fn.getProto().getArgs()};
+		if (visit(Fn.getBody(), E))
+			return true;
+		fprintf(stderr, "error: %s calls '%s', which is not declared with "
+			"that many parameters\n", Name.c_str(), E.BadCallee->Name.c_str());
+		return false;
+	};
+	for (const FunctionEntry *F : Defs) {
+		Out += "\n" + CSignature(*F, F->AST->getProto().getArgs()) +
+		       "\n{\n\treturn ";
+		if (!Emit("'" + F->Name + "'", *F->AST))
+			return false;
+		Out += ";\n}\n";
+	}
+
+	Out += "\n#ifndef CHALICE_NO_MAIN\nint main(void)\n{\n";
+	for (auto &Item : Items) {
+		if (Item.Kind != TopLevelItem::item_expression)
+			continue;
+		Out += "\tprintf(\"Evaluated to %f\\n\", ";
+		if (!Emit("a top-level expression", *Item.Fn))
+			return false;
+		Out += ");\n";
+	}
+	Out += "\treturn 0;\n}\n#endif\n";
+
+	FILE *F = fopen(Path, "w");
+	if (!F) {
+		fprintf(stderr, "error: cannot write '%s'\n", Path);
+		return false;
+	}
+	bool OK = fwrite(Out.data(), 1, Out.size(), F) == Out.size();
+	if (fclose(F) || !OK) {
+		fprintf(stderr, "error: cannot write '%s'\n", Path);
+		return false;
+	}
+	fprintf(stderr, "Wrote %zu functions to %s.\n", Defs.size(), Path);
+	return true;
+}
+
+/*******************************************************************************
+* Direct bytecode emission
+* a second parser for the same grammar that emits bytecode while it parses,
+* for input that is run once and never needs an AST. every emit function gets
+* the first free register Dst, may use it and anything above as scratch, and
+* returns the register that holds its value (a parameter register for plain
+* variables) or -1 after an error. Tail is set for an expression that is the
+* value of the function, a call is in tail position if no operator follows it
+*******************************************************************************/
+
+class DirectEmitter {
+	FunctionTable &M;
+	BCFunction &Fn;
+	const NameList &Params;
+
+	void emit(Opcode Op, unsigned A, uint32_t B = 0, uint32_t C = 0) {
+		Fn.Code.push_back({Op, uint16_t(A), B, C});
+	}
+
+	// make register R usable, -1 if the function would need too many
+	int useReg(unsigned R) {
+		if (R >= MaxRegs) {
+			LogError(diag_too_many_registers);
+			return -1;
+		}
+		Fn.NumRegs = std::max(Fn.NumRegs, R + 1);
+		return R;
+	}
+
+	int emitPrimary(unsigned Dst, bool Tail);
+	int emitIf(unsigned Dst, bool Tail);
+	int emitBinOpRHS(int ExprPrec, int LHS, unsigned Dst);
+	int emitExpression(unsigned Dst, bool Tail = false);
+	bool emitExpressionTo(unsigned Dst, bool Tail);
+
+public:
+	DirectEmitter(FunctionTable &M, BCFunction &Fn, const NameList &Params)
+	: M(M), Fn(Fn), Params(Params) {}
+
+	// parse an expression and emit it as the function body. a top-level
+	// expression runs once and has no tail calls, as in ResolveFunction
+	bool emitBody(bool TopLevel) {
+		Fn.NumRegs = Params.size();
+		int R = emitExpression(Params.size(), !TopLevel);
+		if (R < 0)
+			return false;
+		emit(op_ret, R);
+		return true;
+	}
+};
+
+int DirectEmitter::emitPrimary(unsigned Dst, bool Tail) {
+	switch (CurTok) {
+		case tok_number:
+			if (useReg(Dst) < 0)
+				return -1;
+			Fn.Consts.push_back(NumVal);
+			emit(op_const, Dst, Fn.Consts.size() - 1);
+			getNextToken(); // consume number
+			return Dst;
+		case '(': {
+			getNextToken();
+			int R = emitExpression(Dst);
+			if (R < 0)
+				return -1;
+			if (CurTok != ')') {
+				LogError(diag_expected_rparen);
+				return -1;
+			}
+			getNextToken();
+			return R;
+		}
+		case tok_if:
+			return emitIf(Dst, Tail);
+		case tok_identifier:
+		break;
+		default:
+			LogError(diag_expected_expression);
+			return -1;
+	}
+
+	std::string IdName = IdentifierStr;
+	getNextToken();
+
+	// variables are parameters, they already live in registers
+	if (CurTok != '(') {
+		for (unsigned I = 0; I < Params.size(); ++I)
+			if (Params[I] == IdName)
+				return I;
+		LogError(diag_unknown_variable);
+		return -1;
+	}
+
+	// the arguments go to Dst, Dst+1, ..., where the callee's window starts
+	getNextToken();
+	unsigned NumArgs = 0;
+	if (CurTok != ')') {
+		while (true) {
+			unsigned ArgReg = Dst + NumArgs++;
+			int R = emitExpression(ArgReg);
+			if (R < 0 || useReg(ArgReg) < 0)
+				return -1;
+			if (unsigned(R) != ArgReg)
+				emit(op_move, ArgReg, R);
+
+			if (CurTok == ')')
+				break;
+
+			if (CurTok != ',') {
+				LogError(diag_expected_arg_separator);
+				return -1;
+			}
+			getNextToken();
+		}
+	}
+	if (useReg(Dst) < 0)
+		return -1;
+
+	// arity of a function that is already known is checked now, the VM
+	// checks calls to functions that are defined later
+	const FunctionEntry *Callee = M.find(IdName);
+	if (Callee && Callee->isDeclared() &&
+	    Callee->NumParams != NumArgs) {
+		LogError(diag_argument_count);
+		return -1;
+	}
+
+	// consume ')'
+	getNextToken();
+	if (Tail && GetTokPrecedence() < 0) {
+		emit(op_tailcall, Dst, M.getIndex(IdName), NumArgs);
+		emit(op_ret, Dst);
+		return Dst;
+	}
+	emit(op_call, Dst, M.getIndex(IdName), NumArgs);
+	return Dst;
+}
+
+// both branches leave their value in Dst, the jumps are patched once the
+// branch they skip has been emitted. the else branch takes every operator
+// after it, so an if in tail position has both branches in tail position
+int DirectEmitter::emitIf(unsigned Dst, bool Tail) {
+	getNextToken(); // eat 'if'
+	int Cond = emitExpression(Dst);
+	if (Cond < 0)
+		return -1;
+	if (CurTok != tok_then) {
+		LogError(diag_expected_then);
+		return -1;
+	}
+	getNextToken();
+	size_t JumpToElse = Fn.Code.size();
+	emit(op_jump_false, Cond);
+	if (!emitExpressionTo(Dst, Tail))
+		return -1;
+
+	if (CurTok != tok_else) {
+		LogError(diag_expected_else);
+		return -1;
+	}
+	getNextToken();
+	size_t JumpToEnd = Fn.Code.size();
+	emit(op_jump, 0);
+	Fn.Code[JumpToElse].B = Fn.Code.size();
+	if (!emitExpressionTo(Dst, Tail))
+		return -1;
+	Fn.Code[JumpToEnd].B = Fn.Code.size();
+	return Dst;
+}
+
+// same precedence climbing as ParseBinOpRHS, LHS is in register LHS and the
+// result goes to Dst
+int DirectEmitter::emitBinOpRHS(int ExprPrec, int LHS, unsigned Dst) {
+	while (true) {
+		int TokPrec = GetTokPrecedence();
+
+		if (TokPrec < ExprPrec)
+			return LHS;
+
+		int BinOp = CurTok;
+		getNextToken();
+
+		// RHS is computed above Dst, which may still hold LHS
+		int RHS = emitPrimary(Dst + 1, false);
+		if (RHS < 0)
+			return -1;
+
+		int NextPrec = GetTokPrecedence();
+		if (TokPrec < NextPrec) {
+			RHS = emitBinOpRHS(TokPrec + 1, RHS, Dst + 1);
+			if (RHS < 0)
+				return -1;
+		}
+
+		if (useReg(Dst) < 0)
+			return -1;
+		switch (BinOp) {
+			case '<': emit(op_lt, Dst, LHS, RHS); break;
+			case '+': emit(op_add, Dst, LHS, RHS); break;
+			case '-': emit(op_sub, Dst, LHS, RHS); break;
+			case '*': emit(op_mul, Dst, LHS, RHS); break;
+		}
+		LHS = Dst;
+	}
+}
+
+int DirectEmitter::emitExpression(unsigned Dst, bool Tail) {
+	int LHS = emitPrimary(Dst, Tail);
+	if (LHS < 0)
+		return -1;
+
+	return emitBinOpRHS(0, LHS, Dst);
+}
+
+// emit an expression whose value has to end up in Dst itself
+bool DirectEmitter::emitExpressionTo(unsigned Dst, bool Tail) {
+	int R = emitExpression(Dst, Tail);
+	if (R < 0 || useReg(Dst) < 0)
+		return false;
+	if (unsigned(R) != Dst)
+		emit(op_move, Dst, R);
+	return true;
+}
+
+// functions defined in --direct mode
+static FunctionTable DirectModule;
+
+static void DirectDefinition() {
+	getNextToken(); // eat "def"
+	auto Proto = ParsePrototype();
+	if (!Proto)
+		return SkipToNextItem();
+
+	auto Fn = std::make_unique<BCFunction>();
+	if (!DirectEmitter(DirectModule, *Fn, Proto->getArgs()).emitBody(false))
+		return SkipToNextItem();
+
+	DirectModule.define(Proto->getName(), Proto->getArgs().size()).BC =
+		std::move(Fn);
+	fprintf(stderr, "Parsed a function definition.\n");
+}
+
+static void DirectExtern() {
+	auto Proto = ParseExtern();
+	if (!Proto)
+		return SkipToNextItem();
+	if (Proto->getArgs().size() > MaxExternArgs) {
+		LogError(diag_too_many_extern_args);
+		return SkipToNextItem();
+	}
+
+	DirectModule.declareExtern(*Proto);
+	fprintf(stderr, "Parsed an extern.\n");
+}
+
+static void DirectTopLevelExpr() {
+	BCFunction Fn;
+	NameList NoParams;
+	if (!DirectEmitter(DirectModule, Fn, NoParams).emitBody(true))
+		return SkipToNextItem();
+
+	double Result;
+	const char *Err;
+	if (RunBytecode(DirectModule, Fn, &Result, &Err))
+		fprintf(stderr, "Evaluated to %f\n", Result);
+	else
+		fprintf(stderr, "error: %s\n", Err);
+}
+
+// MainLoop for --direct
+static void DirectLoop() {
+	while (true) {
+		if (FlushErrors())
+			return;
+		Prompt();
+		switch (CurTok) {
+			case tok_eof:
+			return;
+			case ';': //ignore top-level semicolons
+				getNextToken();
+			break;
+			case tok_def:
+				DirectDefinition();
+			break;
+			case tok_extern:
+				DirectExtern();
+			break;
+			default:
+				DirectTopLevelExpr();
+			break;
+		}
+	}
+}
+
+/*******************************************************************************
+* Benchmarks
+* synthetic inputs that stress one part of the parser each, parsed both from a
+* pre-lexed token buffer and end to end from the source text, and small
+* programs run on each execution backend
+*******************************************************************************/
+
+struct BenchCase {
+	std::string Name;
+	std::string Source;
+};
+
+struct BenchResult {
+	std::string Name;
+	const char *Mode;	// "prelexed" or "end-to-end"
+	size_t Bytes;		// source size
+	size_t Tokens;
+	size_t Nodes;
+	double Seconds;		// best of the repetitions
+	size_t PeakBytes;	// heap high-water mark of one run
+};
+
+static std::vector<BenchCase> MakeBenchCases() {
+	std::vector<BenchCase> Cases;
+	char Buf[64];
+
+	// a chain of 100 operands per def for each operator, left to right at one
+	// precedence level
+	for (auto &P : BinopPrecedence) {
+		BenchCase C;
+		C.Name = std::string("chain '") + P.first + "'";
+		for (int I = 0; I < 1000; ++I) {
+			snprintf(Buf, sizeof(Buf), "def c%d(x) x", I);
+			C.Source += Buf;
+			for (int J = 0; J < 99; ++J)
+				C.Source += std::string(" ") + P.first + " x";
+			C.Source += ";\n";
+		}
+		Cases.push_back(std::move(C));
+	}
+
+	// all operators mixed, so ParseBinOpRHS keeps recursing and returning
+	{
+		BenchCase C;
+		C.Name = "chain mixed";
+		std::string Ops;
+		for (auto &P : BinopPrecedence)
+			Ops += P.first;
+		for (int I = 0; I < 1000; ++I) {
+			snprintf(Buf, sizeof(Buf), "def m%d(x y) x", I);
+			C.Source += Buf;
+			for (int J = 0; J < 99; ++J)
+				C.Source += std::string(" ") + Ops[(I + J * 3) % Ops.size()] +
+					    (J % 2 ? " x" : " y");
+			C.Source += ";\n";
+		}
+		Cases.push_back(std::move(C));
+	}
+
+	{
+		BenchCase C;
+		C.Name = "deep parens";
+		for (int I = 0; I < 200; ++I)
+			C.Source += std::string(500, '(') + "1" + std::string(500, ')') + ";\n";
+		Cases.push_back(std::move(C));
+	}
+
+	{
+		BenchCase C;
+		C.Name = "wide calls";
+		for (int I = 0; I < 200; ++I) {
+			C.Source += "f(0";
+			for (int J = 1; J < 1000; ++J) {
+				snprintf(Buf, sizeof(Buf), ", %d", J);
+				C.Source += Buf;
+			}
+			C.Source += ");\n";
+		}
+		Cases.push_back(std::move(C));
+	}
+
+	{
+		BenchCase C;
+		C.Name = "tiny defs";
+		for (int I = 0; I < 100000; ++I) {
+			snprintf(Buf, sizeof(Buf), "def f%d(x) x;\n", I);
+			C.Source += Buf;
+		}
+		Cases.push_back(std::move(C));
+	}
+
+	{
+		BenchCase C;
+		C.Name = "prototypes";
+		for (int I = 0; I < 50000; ++I) {
+			snprintf(Buf, sizeof(Buf), "extern e%d(a b c d e f);\n", I);
+			C.Source += Buf;
+		}
+		Cases.push_back(std::move(C));
+	}
+
+	{
+		BenchCase C;
+		C.Name = "errors";
+		for (int I = 0; I < 50000; ++I)
+			C.Source += ") def (x) 1 + * foo(1,,2) extern 3;\n";
+		Cases.push_back(std::move(C));
+	}
+
+	return Cases;
+}
+
+static size_t CountNodes(const ParsedChunk &Chunk) {
+	ASTStats Stats;
+	for (auto &Item : Chunk.Items) {
+		if (Item.Fn)
+			CollectASTStats(*Item.Fn, Stats);
+		else if (Item.Proto)
+			CollectASTStats(*Item.Proto, Stats);
+	}
+	return Stats.totalNodes();
+}
+
+static std::vector<TokenRec> LexString(const std::string &Source) {
+	FILE *F = fmemopen(const_cast<char *>(Source.data()), Source.size(), "r");
+	ResetLexer(F);
+	auto Toks = LexAll();
+	fclose(F);
+	ResetLexer(stdin);
+	return Toks;
+}
+
+// time Run until it has taken at least a quarter second, keep the best run
+template <typename Fn>
+static double TimeBest(Fn Run) {
+	double Best = 1e30, Total = 0;
+	for (int I = 0; I < 3 || Total < 0.25; ++I) {
+		auto Start = std::chrono::steady_clock::now();
+		Run();
+		double T = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - Start).count();
+		Best = std::min(Best, T);
+		Total += T;
+	}
+	return Best;
+}
+
+static std::vector<BenchResult> RunParserBenchmarks() {
+	std::vector<BenchResult> Results;
+	// broken input has to be parsed to the end
+	unsigned SavedMaxErrors = MaxErrors;
+	MaxErrors = 0;
+
+	for (auto &C : MakeBenchCases()) {
+		auto Toks = LexString(C.Source);
+		size_t Nodes = CountNodes(ParseItems(Toks.data(), Toks.data() + Toks.size()));
+
+		BenchResult R = {C.Name, "prelexed", C.Source.size(), Toks.size(), Nodes, 0, 0};
+		ThreadAllocs.Peak = ThreadAllocs.Live;
+		R.Seconds = TimeBest([&]() {
+			ParseItems(Toks.data(), Toks.data() + Toks.size());
+		});
+		R.PeakBytes = ThreadAllocs.Peak - ThreadAllocs.Live;
+		Results.push_back(R);
+
+		// end to end: lex from the source text while parsing, with no token
+		// buffer in between
+		R.Mode = "end-to-end";
+		ThreadAllocs.Peak = ThreadAllocs.Live;
+		R.Seconds = TimeBest([&]() {
+			FILE *F = fmemopen(const_cast<char *>(C.Source.data()),
+					   C.Source.size(), "r");
+			ResetLexer(F);
+			ParseItems(nullptr, nullptr);
+			fclose(F);
+		});
+		ResetLexer(stdin);
+		R.PeakBytes = ThreadAllocs.Peak - ThreadAllocs.Live;
+		Results.push_back(R);
+	}
+
+	MaxErrors = SavedMaxErrors;
+	return Results;
+}
+
+static void PrintBenchResults(const std::vector<BenchResult> &Results, bool JSON) {
+	if (JSON) {
+		printf("[\n");
+		for (size_t I = 0; I < Results.size(); ++I) {
+			auto &R = Results[I];
+			std::string Name;
+			for (char Ch : R.Name) {
+				if (Ch == '"' || Ch == '\\')
+					Name += '\\';
+				Name += Ch;
+			}
+			printf("  {\"name\": \"%s\", \"mode\": \"%s\", \"bytes\": %zu, "
+			       "\"tokens\": %zu, \"nodes\": %zu, \"seconds\": %.6f, "
+			       "\"tokens_per_s\": %.0f, \"nodes_per_s\": %.0f, "
+			       "\"peak_bytes\": %zu}%s\n",
+			       Name.c_str(), R.Mode, R.Bytes, R.Tokens, R.Nodes, R.Seconds,
+			       R.Tokens / R.Seconds, R.Nodes / R.Seconds, R.PeakBytes,
+			       I + 1 < Results.size() ? "," : "");
+		}
+		printf("]\n");
+		return;
+	}
+
+	printf("%-14s %-10s %10s %10s %10s %12s %12s %12s\n", "case", "mode",
+	       "tokens", "nodes", "ms", "Mtokens/s", "Mnodes/s", "peak KiB");
+	for (auto &R : Results)
+		printf("%-14s %-10s %10zu %10zu %10.2f %12.2f %12.2f %12zu\n",
+		       R.Name.c_str(), R.Mode, R.Tokens, R.Nodes, R.Seconds * 1e3,
+		       R.Tokens / R.Seconds / 1e6, R.Nodes / R.Seconds / 1e6,
+		       R.PeakBytes / 1024);
+}
+
+// programs for the execution backends, each ends in the expression to time
+struct ExecBenchCase {
+	const char *Name;
+	const char *Source;
+};
+
+static const ExecBenchCase ExecBenchCases[] = {
+	// call bound
+	{"fib", "def fib(n) if n < 2 then n else fib(n-1) + fib(n-2);\n"
+		"fib(25);\n"},
+	// arithmetic in a loop, sum recurses 1000 deep under a fan-out
+	{"poly", "def poly(x) ((x*3 - 2)*x + 7)*x - 1;\n"
+		 "def sum(i acc) if i < 1 then acc else sum(i-1, acc + poly(i*0.001));\n"
+		 "def rep(d) if d < 1 then sum(1000, 0) else rep(d-1) + rep(d-1);\n"
+		 "rep(6);\n"},
+	// calls into C
+	{"extern", "extern sin(x);\nextern cos(x);\n"
+		   "def wave(i acc) if i < 1 then acc else wave(i-1, acc + sin(i)*cos(i));\n"
+		   "def rep(d) if d < 1 then wave(1000, 0) else rep(d-1) + rep(d-1);\n"
+		   "rep(6);\n"},
+};
+
+struct ExecBenchResult {
+	const char *Name;
+	const char *Backend;
+	double CompileSeconds;	// preparing every function of the program
+	double Seconds;		// best run of the expression
+	double Value;
+	bool OK;
+};
+
+// call a prepared function without parameters the way the backend would
+static bool RunPrepared(const FunctionEntry &F, double *Result, const char **Err) {
+#if defined(CHALICE_HAVE_JIT) || defined(CHALICE_WITH_LLVM)
+	if ((ExecBackend == backend_jit || ExecBackend == backend_llvm) && F.JITCode &&
+	    F.JITCode != reinterpret_cast<void *>(&JITCallSlow)) {
+		RunJITCode(F.JITCode, Result, Err);
+		return !*Err;
+	}
+#endif
+	if (ExecBackend != backend_eval && F.BC)
+		return RunBytecode(Functions, *F.BC, Result, Err);
+	return Evaluate(Functions, *F.AST, Result, Err);
+}
+
+// run every program on every backend built in, each in a function table of
+// its own. the final expression is compiled like a definition, so its run
+// time doesn't include compiling it
+static std::vector<ExecBenchResult> RunBackendBenchmarks() {
+	static const std::pair<Backend, const char *> Backends[] = {
+		{backend_eval, "eval"},
+		{backend_vm, "vm"},
+#ifdef CHALICE_HAVE_JIT
+		{backend_jit, "jit"},
+		{backend_tiered, "tiered"},
+#endif
+#ifdef CHALICE_WITH_LLVM
+		{backend_llvm, "llvm"},
+#endif
+	};
+	std::vector<ExecBenchResult> Results;
+	Backend SavedBackend = ExecBackend;
+	unsigned SavedTierUpCalls = TierUpCalls;
+
+	for (auto &C : ExecBenchCases) {
+		auto Toks = LexString(C.Source);
+		for (auto &B : Backends) {
+			ExecBackend = B.first;
+			TierUpCalls = B.first == backend_tiered ? DefaultTierUpCalls : 0;
+			FunctionTable Table;
+			std::swap(Table, Functions);
+
+			ExecBenchResult R = {C.Name, B.second, 0, 0, 0, false};
+			auto Chunk = ParseItems(Toks.data(), Toks.data() + Toks.size());
+			FunctionEntry *Expr = nullptr;
+			auto Start = std::chrono::steady_clock::now();
+			for (auto &Item : Chunk.Items) {
+				if (Item.Proto) {
+					if (FunctionEntry *F = Functions.declareExtern(*Item.Proto))
+						PrepareFunction(*F);
+				} else if (Item.Fn && ResolveFunction(Functions, *Item.Fn)) {
+					Expr = &Functions.define(std::move(Item.Fn));
+					PrepareFunction(*Expr);
+				}
+			}
+			R.CompileSeconds = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - Start).count();
+
+			if (Expr) {
+				const char *Err;
+				R.OK = RunPrepared(*Expr, &R.Value, &Err);
+				R.Seconds = TimeBest([&]() {
+					RunPrepared(*Expr, &R.Value, &Err);
+				});
+			}
+			Results.push_back(R);
+			std::swap(Table, Functions);
+		}
+	}
+
+	ExecBackend = SavedBackend;
+	TierUpCalls = SavedTierUpCalls;
+	return Results;
+}
+
+static void PrintBackendBenchResults(const std::vector<ExecBenchResult> &Results,
+				     bool JSON) {
+	if (JSON) {
+		printf("[\n");
+		for (size_t I = 0; I < Results.size(); ++I) {
+			auto &R = Results[I];
+			printf("  {\"name\": \"%s\", \"backend\": \"%s\", "
+			       "\"compile_seconds\": %.6f, \"seconds\": %.6f, "
+			       "\"value\": %.17g, \"ok\": %s}%s\n",
+			       R.Name, R.Backend, R.CompileSeconds, R.Seconds, R.Value,
+			       R.OK ? "true" : "false", I + 1 < Results.size() ? "," : "");
+		}
+		printf("]\n");
+		return;
+	}
+
+	printf("%-14s %-10s %12s %10s %10s %16s\n", "case", "backend", "compile ms",
+	       "ms", "speedup", "value");
+	double Base = 0;
+	for (auto &R : Results) {
+		// relative to the evaluator, which comes first for each case
+		if (!strcmp(R.Backend, "eval"))
+			Base = R.Seconds;
+		printf("%-14s %-10s %12.3f %10.3f %9.1fx %16.6g%s\n", R.Name, R.Backend,
+		       R.CompileSeconds * 1e3, R.Seconds * 1e3, Base / R.Seconds, R.Value,
+		       R.OK ? "" : " (error)");
+	}
+}
+
+/*******************************************************************************
+* Main driver code
+*******************************************************************************/
+
+// 0 parses interactively, otherwise the number of parser threads
+static unsigned ParseThreads = 0;
+// files to read instead of stdin
+static std::vector<const char *> InputFiles;
+// treat the input files as successive versions of one document
+static bool Incremental = false;
+// 1 for --batch, 0 for --interactive, -1 to decide by whether stdin is a tty
+static int Batch = -1;
+// write the parsed input as an AST image / load one before the input
+static const char *EmitASTPath = nullptr;
+static const char *LoadASTPath = nullptr;
+// compile the definitions to an object file or shared library
+static const char *EmitObjPath = nullptr;
+// translate the input to C
+static const char *EmitCPath = nullptr;
+// compile straight to bytecode while parsing and run top-level expressions
+static bool Direct = false;
+// run the benchmarks instead of reading input, optionally printing JSON
+static bool Bench = false;
+static bool BenchJSON = false;
+// the same for the execution backends
+static bool BenchBackends = false;
+
+static void ParseArgs(int argc, char **argv) {
+	for (int I = 1; I < argc; ++I) {
+		const char *Arg = argv[I];
+		if (!strcmp(Arg, "--parallel")) {
+			ParseThreads = std::max(1u, std::thread::hardware_concurrency());
+		} else if (!strncmp(Arg, "--parallel=", 11)) {
+			ParseThreads = std::max(1, atoi(Arg + 11));
+		} else if (!strncmp(Arg, "--max-errors=", 13)) {
+			MaxErrors = atoi(Arg + 13);
+		} else if (!strcmp(Arg, "--fold")) {
+			FoldConstants = true;
+		} else if (!strcmp(Arg, "--dump-ast")) {
+			DumpAST = true;
+		} else if (!strcmp(Arg, "--ast-stats")) {
+			ShowASTStats = true;
+		} else if (!strcmp(Arg, "--sharing-stats")) {
+			ShowSharing = true;
+		} else if (!strcmp(Arg, "--emit-ast") && I + 1 < argc) {
+			EmitASTPath = argv[++I];
+		} else if (!strcmp(Arg, "--load-ast") && I + 1 < argc) {
+			LoadASTPath = argv[++I];
+		} else if (!strcmp(Arg, "--emit-obj") && I + 1 < argc) {
+#ifndef CHALICE_HAVE_JIT
+			fprintf(stderr, "error: object files are only written on "
+				"x86-64\n");
+			exit(1);
+#endif
+			EmitObjPath = argv[++I];
+		} else if (!strcmp(Arg, "--emit-c") && I + 1 < argc) {
+			EmitCPath = argv[++I];
+		} else if (!strcmp(Arg, "--bench")) {
+			Bench = true;
+		} else if (!strcmp(Arg, "--bench-json")) {
+			Bench = BenchJSON = true;
+		} else if (!strcmp(Arg, "--bench-backends")) {
+			BenchBackends = true;
+		} else if (!strcmp(Arg, "--bench-backends-json")) {
+			BenchBackends = BenchJSON = true;
+		} else if (!strcmp(Arg, "--stream")) {
+			Streaming = true;
+		} else if (!strncmp(Arg, "--memory-limit=", 15)) {
+			char *End;
+			MemoryLimit = strtoll(Arg + 15, &End, 10);
+			switch (*End) {
+				case 'G': MemoryLimit <<= 10; // fall through
+				case 'M': MemoryLimit <<= 10; // fall through
+				case 'K': MemoryLimit <<= 10;
+			}
+			Streaming = true;
+		} else if (!strcmp(Arg, "--direct")) {
+			Direct = true;
+		} else if (!strcmp(Arg, "--backend=eval")) {
+			ExecBackend = backend_eval;
+		} else if (!strcmp(Arg, "--backend=vm")) {
+			ExecBackend = backend_vm;
+		} else if (!strcmp(Arg, "--backend=jit")) {
+			ExecBackend = backend_jit;
+		} else if (!strcmp(Arg, "--backend=tiered")) {
+			ExecBackend = backend_tiered;
+		} else if (!strcmp(Arg, "--memoize")) {
+			MemoizeRecursive = true;
+		} else if (!strncmp(Arg, "--memoize=", 10)) {
+			for (const char *P = Arg + 10; *P;) {
+				size_t Len = strcspn(P, ",");
+				MemoizeNames.insert(std::string(P, Len));
+				P += Len + (P[Len] == ',');
+			}
+		} else if (!strcmp(Arg, "--no-inline")) {
+			InlineCalls = false;
+		} else if (!strncmp(Arg, "--max-depth=", 12)) {
+			MaxCallDepth = std::max(1, atoi(Arg + 12));
+		} else if (!strncmp(Arg, "--tier-up=", 10)) {
+			ExecBackend = backend_tiered;
+			TierUpCalls = std::max(1, atoi(Arg + 10));
+		} else if (!strcmp(Arg, "--backend=llvm")) {
+#ifndef CHALICE_WITH_LLVM
+			fprintf(stderr, "error: built without LLVM, rebuild with "
+				"-DCHALICE_WITH_LLVM\n");
+			exit(1);
+#endif
+			ExecBackend = backend_llvm;
+		} else if (!strcmp(Arg, "--incremental")) {
+			Incremental = true;
+		} else if (!strcmp(Arg, "--batch")) {
+			Batch = 1;
+		} else if (!strcmp(Arg, "--interactive")) {
+			Batch = 0;
+		} else if (Arg[0] != '-') {
+			InputFiles.push_back(Arg);
+		} else {
+			fprintf(stderr, "usage: %s [--batch | --interactive] "
+				"[--parallel[=N]] [--max-errors=N]\n       "
+				"[--fold] [--dump-ast] [--ast-stats] [--sharing-stats]\n"
+				"       [--emit-ast file] [--load-ast file] "
+				"[--emit-obj file.o|file.so]\n"
+				"       [--emit-c file.c]"
+				" [--direct] [--backend=eval|vm|jit|tiered|llvm]\n"
+				"       [--tier-up=N] [--memoize[=name,...]] [--max-depth=N]"
+				" [--no-inline]\n"
+				"       [--bench | --bench-json] "
+				"[--bench-backends | --bench-backends-json]\n"
+				"       [--stream] [--memory-limit=N[KMG]] [--incremental]\n"
+				"       [file...]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	// allocations per item, peak memory and the memory limit
+	CountAllocs = ShowASTStats || Streaming || Bench;
+
+	// streaming handles and drops one item at a time within the memory
+	// limit, parallel parsing holds on to all of them and checks no limit
+	if (ParseThreads && Streaming) {
+		fprintf(stderr, "error: --parallel can't be combined with --stream "
+			"or --memory-limit\n");
+		exit(1);
+	}
+
+	// --direct runs the input as it parses it, with no AST and no items for
+	// the other modes to work on
+	if (Direct) {
+		const char *Mode = ParseThreads ? "--parallel" :
+				   EmitASTPath ? "--emit-ast" :
+				   EmitObjPath ? "--emit-obj" :
+				   EmitCPath ? "--emit-c" :
+				   LoadASTPath ? "--load-ast" :
+				   Incremental ? "--incremental" :
+				   Streaming ? "--stream or --memory-limit" : nullptr;
+		if (Mode) {
+			fprintf(stderr, "error: --direct can't be combined with %s\n", Mode);
+			exit(1);
+		}
+		for (auto Opt : {std::make_pair(FoldConstants, "--fold"),
+				 std::make_pair(DumpAST, "--dump-ast"),
+				 std::make_pair(ShowASTStats, "--ast-stats"),
+				 std::make_pair(ShowSharing, "--sharing-stats")})
+			if (Opt.first)
+				fprintf(stderr, "warning: %s does nothing with --direct\n",
+					Opt.second);
+	}
+}
+
+// parse each file as a new version of the same document and report how much
+// of the previous version could be reused
+static void ReparseFiles() {
+	IncrementalParser Parser;
+	for (const char *Name : InputFiles) {
+		FILE *F = fopen(Name, "r");
+		if (!F) {
+			fprintf(stderr, "error: cannot open '%s'\n", Name);
+			exit(1);
+		}
+		ResetLexer(F);
+		InputName = Name;
+		auto Toks = LexAll();
+		fclose(F);
+
+		auto Start = std::chrono::steady_clock::now();
+		auto Items = Parser.update(Toks);
+		auto Elapsed = std::chrono::steady_clock::now() - Start;
+
+		Diags.finish(stderr);
+		fprintf(stderr, "%s: %zu items, %u reused, %u reparsed in %lld us\n",
+			Name, Items.size(), Parser.NumReused, Parser.NumReparsed,
+			(long long)std::chrono::duration_cast<
+				std::chrono::microseconds>(Elapsed).count());
+	}
+}
+
+// everything after the options, run on the program stack
+static int RunMain() {
+	// only the tiered backend compiles functions as they get hot
+	if (ExecBackend != backend_tiered)
+		TierUpCalls = 0;
+
+	if (Bench) {
+		PrintBenchResults(RunParserBenchmarks(), BenchJSON);
+		return 0;
+	}
+	if (BenchBackends) {
+		PrintBackendBenchResults(RunBackendBenchmarks(), BenchJSON);
+		return 0;
+	}
+
+	if (Incremental) {
+		ReparseFiles();
+		return Diags.hasErrors();
+	}
+
+	// batch mode drops the prompts and writes everything through one big
+	// buffer instead of a write per line to unbuffered stderr
+	if (Batch < 0)
+		Batch = !InputFiles.empty() || !isatty(STDIN_FILENO);
+	if (Batch) {
+		Interactive = false;
+		setvbuf(stderr, nullptr, _IOFBF, 1 << 20);
+	}
+
+	// the image comes before the input, which can call what it defines
+	if (LoadASTPath && !LoadASTImage(LoadASTPath))
+		return 1;
+
+	// the emit modes write the whole input out instead of running it. they
+	// and --parallel parse a token buffer up front, otherwise each item is
+	// handled as soon as it is parsed
+	bool EmitOnly = EmitASTPath || EmitObjPath || EmitCPath;
+	bool KeepItems = ParseThreads || EmitOnly;
+	std::vector<TopLevelItem> Items;
+	auto ProcessInput = [&]() {
+		if (KeepItems) {
+			auto Toks = ParseThreads ? LexParallel(InputFile, ParseThreads)
+						 : LexAll();
+			auto New = ParseParallel(Toks, std::max(1u, ParseThreads));
+			if (!EmitOnly)
+				return HandleItems(New);
+			for (auto &Item : New)
+				Items.push_back(std::move(Item));
+			return;
+		}
+		Prompt();
+		getNextToken();
+		if (Direct)
+			DirectLoop();
+		else
+			MainLoop();
+	};
+
+	if (InputFiles.empty())
+		ProcessInput();
+	for (const char *Name : InputFiles) {
+		FILE *F = fopen(Name, "r");
+		if (!F) {
+			fprintf(stderr, "error: cannot open '%s'\n", Name);
+			return 1;
+		}
+		ResetLexer(F);
+		InputName = Name;
+		ProcessInput();
+		fclose(F);
+	}
+
+	Diags.finish(stderr);
+	if (EmitOnly) {
+		ReportItems(Items);
+		if (EmitASTPath && !WriteASTImage(Items, EmitASTPath)) {
+			fprintf(stderr, "error: cannot write '%s'\n", EmitASTPath);
+			return 1;
+		}
+#ifdef CHALICE_HAVE_JIT
+		if (EmitObjPath && (Diags.hasErrors() || !WriteNativeObject(Items, EmitObjPath)))
+			return 1;
+#endif
+		if (EmitCPath && (Diags.hasErrors() || !WriteCSource(Items, EmitCPath)))
+			return 1;
+	}
+	if (ShowASTStats)
+		TotalASTStats.print(stderr);
+	if (Streaming)
+		PrintStreamStats(stderr);
+
+	return Diags.hasErrors();
+}
+
+int main(int argc, char **argv) {
+	// 1 is lowest precedence
+	BinopPrecedence['<'] = 10;
+	BinopPrecedence['+'] = 20;
+	BinopPrecedence['-'] = 30;
+	BinopPrecedence['*'] = 40;
+
+	ParseArgs(argc, argv);
+	return RunOnProgramStack(RunMain);
 }
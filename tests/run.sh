@@ -0,0 +1,32 @@
+#!/bin/sh
+# regression tests. every tests/*.k starts with one or more lines
+#   # run: <shell command>
+# run in order with $CHALICE set to the interpreter, $TEST to the .k file and
+# $TMP to a scratch directory. together they have to print exactly what is in
+# tests/<name>.out, stdout and stderr merged
+#
+# usage: tests/run.sh [path to the interpreter, default ./chalice]
+
+CHALICE=$(cd "$(dirname "${1:-./chalice}")" && pwd)/$(basename "${1:-./chalice}")
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+export CHALICE TMP
+
+Failed=0
+for TEST in "$DIR"/*.k; do
+	Name=$(basename "$TEST" .k)
+	export TEST
+	sed -n 's/^# run: //p' "$TEST" | while IFS= read -r Cmd; do
+		timeout 60 sh -c "$Cmd" < /dev/null 2>&1
+	done > "$TMP/$Name.out"
+	if cmp -s "$DIR/$Name.out" "$TMP/$Name.out"; then
+		echo "PASS $Name"
+	else
+		echo "FAIL $Name"
+		diff "$DIR/$Name.out" "$TMP/$Name.out" | head -20
+		Failed=$((Failed + 1))
+	fi
+done
+echo "$Failed failed"
+[ "$Failed" -eq 0 ]